@@ -1,19 +1,42 @@
+// clCreateCommandQueue is deprecated by OpenCL 2.0 headers, but remains the only choice for 1.x platforms
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #include "CL/cl.h"
 extern "C" {
 #include "lua.h"
 #include "lauxlib.h"
 }
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <new>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef GetClassName
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 typedef void (*push_t)(lua_State*L, const void* value, size_t size);
 
+#define countof(a) (sizeof(a)/sizeof(a[0]))
+
 enum eInfoTable
 {
 	IT_PLATFORM, IT_DEVICE, IT_CONTEXT, IT_QUEUE, 
 	IT_MEM, IT_IMAGE, IT_SAMPLER, IT_PROGRAM, 
-	IT_PROGRAM_BUILD, IT_KERNEL, IT_WORKGROUP, IT_EVENT, 
+	IT_PROGRAM_BUILD, IT_KERNEL, IT_KERNEL_ARG, IT_WORKGROUP, IT_EVENT, 
 	IT_PROFILING, IT_MAX
 };
 enum enumTypes
@@ -25,6 +48,7 @@ enum enumTypes
 	EBT_ADDRESSING_MODE, EBT_FILTER_MODE, EBT_MAP_FLAGS, EBT_PROGRAM_BINARY_TYPE, 
 	EBT_BUILD_STATUS, EBT_KERNEL_ARG_ADDRESS_QUALIFIER, EBT_KERNEL_ARG_ACCESS_QUALIFIER, 
 	EBT_KERNEL_ARG_TYPE_QUALIFIER, EBT_COMMAND_TYPE, EBT_COMMAND_EXECUTION_STATUS, EBT_BUFFER_CREATE_TYPE, 
+	EBT_DEVICE_SVM_CAPABILITIES, 
 };
 
 struct info_list_t
@@ -50,6 +74,8 @@ struct enum_list_t
 static int getInfoTable(const info_list_t*& pinfo, eInfoTable info_table);
 static int getEnumTable(const enum_list_t*& ptable, enumTypes enum_type);
 static void error_check(lua_State* L, int error_code);
+static const char* error_string(int error_code);
+static void check_type(lua_State* L, int idx, int types);
 static void pushEnum(lua_State*L, const void* ptr, size_t size, enumTypes enum_type);
 static void pushBitField(lua_State*L, const void* ptr, size_t size, enumTypes enum_type);
 
@@ -111,7 +137,11 @@ static int push_info(lua_State* L, id_t id, eInfoTable info_table, get_info_t ge
 	for(int i=0;i<nb;i++)
 	{
 		size_t size;
-		error_check(L, get_info_fct(id, info_list[i].id, 0, NULL, &size));
+		cl_int err = get_info_fct(id, info_list[i].id, 0, NULL, &size);
+		// Queries from a newer version than the one of the object are skipped
+		if(err == CL_INVALID_VALUE)
+			continue;
+		error_check(L, err);
 		void* pinfo = lua_newuserdata(L, size);
 		error_check(L, get_info_fct(id, info_list[i].id, size, pinfo, NULL));
 		info_list[i].pushFct(L, pinfo, size);
@@ -121,8 +151,8 @@ static int push_info(lua_State* L, id_t id, eInfoTable info_table, get_info_t ge
 	return 1;
 }
 
-template<class id_t, class get_info_t>
-static int push_info(lua_State* L, id_t id, eInfoTable info_table, get_info_t get_info_fct, cl_device_id device)
+template<class id_t, class sub_id_t, class get_info_t>
+static int push_info(lua_State* L, id_t id, eInfoTable info_table, get_info_t get_info_fct, sub_id_t sub_id)
 {
 	const info_list_t* info_list;
 	int nb = getInfoTable(info_list, info_table);
@@ -131,9 +161,13 @@ static int push_info(lua_State* L, id_t id, eInfoTable info_table, get_info_t ge
 	for(int i=0;i<nb;i++)
 	{
 		size_t size;
-		error_check(L, get_info_fct(id, device, info_list[i].id, 0, NULL, &size));
+		cl_int err = get_info_fct(id, sub_id, info_list[i].id, 0, NULL, &size);
+		// Queries from a newer version than the one of the object are skipped
+		if(err == CL_INVALID_VALUE)
+			continue;
+		error_check(L, err);
 		void* pinfo = lua_newuserdata(L, size);
-		error_check(L, get_info_fct(id, device, info_list[i].id, size, pinfo, NULL));
+		error_check(L, get_info_fct(id, sub_id, info_list[i].id, size, pinfo, NULL));
 		info_list[i].pushFct(L, pinfo, size);
 		lua_setfield(L, top, info_list[i].name);
 		lua_settop(L, top);
@@ -177,24 +211,6 @@ static void pushBitField(lua_State*L, const void* ptr, size_t size, enumTypes en
 	luaL_pushresult(&buf);
 }
 
-void pushBinaries(lua_State*L, const void* ptr, size_t size)
-{
-	int nbelem = (int)size/sizeof(unsigned char*);
-	const char** data = (const char**)ptr;
-	luaL_checktype(L, -1, LUA_TTABLE);
-	lua_createtable(L, nbelem, 0);
-	int top = lua_gettop(L);
-	for(int i=0;i<nbelem;i++)
-	{
-		lua_getfield(L, -2, "binary_sizes");
-		size_t size = (size_t)luaL_checknumber(L, -1);
-		lua_settop(L, top);
-		lua_pushlstring(L, data[i], size);
-		lua_rawseti(L, -2, i+1);
-	}
-	lua_replace(L, -2);
-}
-
 int GetEnumValue(lua_State* L, enumTypes enum_type, const char* str)
 {
 	const enum_list_t* ptable;
@@ -205,6 +221,39 @@ int GetEnumValue(lua_State* L, enumTypes enum_type, const char* str)
 	luaL_error(L, "enumeration value '%s' not found", str);
 	return 0;
 }
+
+// Accepts either a table of names or a string in the "a, b" format produced by pushBitField
+cl_bitfield GetBitFieldValue(lua_State* L, int idx, enumTypes enum_type)
+{
+	cl_bitfield val = 0;
+	if(lua_type(L, idx) == LUA_TTABLE)
+	{
+		size_t nb = lua_rawlen(L, idx);
+		for(size_t i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, idx, (int)i+1);
+			val |= GetEnumValue(L, enum_type, luaL_checkstring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	else if(!lua_isnoneornil(L, idx))
+	{
+		const char* str = luaL_checkstring(L, idx);
+		while(*str)
+		{
+			size_t len = strcspn(str, ", ");
+			if(len)
+			{
+				lua_pushlstring(L, str, len);
+				val |= GetEnumValue(L, enum_type, lua_tostring(L, -1));
+				lua_pop(L, 1);
+			}
+			str += len;
+			str += strspn(str, ", ");
+		}
+	}
+	return val;
+}
 static void context_info(lua_State* L)
 {
 #if 0
@@ -256,78 +305,2097 @@ public:
 		lua_pop(L, 2);
 		return obj;
 	}
-	void AddMethod(lua_State* L, lua_method fct, const char* name) 
+	// Same as CheckObject, but returns NULL instead of raising an error
+	static CLObject* TestObject(lua_State* L, int idx, const char* name)
+	{
+		if(lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+			return NULL;
+		lua_getfield(L, -1, "__metatable");
+		bool valid = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "OpenCL metatable") == 0;
+		lua_pop(L, 2);
+		CLObject* obj = (CLObject*)lua_touserdata(L, idx);
+		if(!valid || strcmp(obj->GetClassName(), name))
+			return NULL;
+		return obj;
+	}
+	void AddMethod(lua_State* L, lua_method fct, const char* name) 
+	{
+		lua_pushlightuserdata(L, this);
+		lua_method* ud = (lua_method*)lua_newuserdata(L, sizeof fct);
+		*ud = fct;
+		lua_pushcclosure(L, CallMethod, 2); 
+		lua_setfield(L, -2, name); 
+	}
+	void Register(lua_State* L)
+	{
+		lua_createtable(L, 0, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		lua_pushliteral(L, "OpenCL metatable");
+		lua_setfield(L, -2, "__metatable");
+		AddMethods(L);
+		lua_setmetatable(L, -2);
+	}
+	virtual const char* GetClassName() = 0;
+	int ToString(lua_State* L) { lua_pushfstring(L, "OpenCL %s (%p)", GetClassName(), this); return 1; }
+	int GC(lua_State* L) { Release(); return 0; }
+	virtual void AddMethods(lua_State* L)
+	{
+		AddMethod(L, &CLObject::GetInfo, "info");
+		AddMethod(L, &CLObject::ToString, "__tostring");
+		AddMethod(L, &CLObject::GC, "__gc");
+	}
+private:
+};
+
+class CLDevice : public CLObject
+{
+public:
+	CLDevice(cl_device_id id) : Handle(id) {}
+#ifdef CL_VERSION_1_2
+	virtual void Retain() { clRetainDevice(Handle); }
+	virtual void Release() { clReleaseDevice(Handle); }
+#endif
+	operator cl_device_id const() { return Handle; }
+	virtual const char* GetClassName() { return "device"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_DEVICE, clGetDeviceInfo); }
+private:
+	cl_device_id Handle;
+};
+
+class CLPlatform : public CLObject
+{
+public:
+	CLPlatform(cl_platform_id id) : Handle(id) {}
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_PLATFORM, clGetPlatformInfo); }
+	virtual const char* GetClassName() { return "platform"; }
+	int GetDevices(lua_State* L)
+	{
+		cl_uint nb;
+		error_check(L, clGetDeviceIDs(Handle, CL_DEVICE_TYPE_ALL, 0, NULL, &nb));
+		cl_device_id* ids = (cl_device_id*) lua_newuserdata(L, nb * sizeof(cl_device_id));
+		error_check(L, clGetDeviceIDs(Handle, CL_DEVICE_TYPE_ALL, nb, ids, NULL));
+		lua_createtable(L, nb, 0);
+		for(cl_uint i=0;i<nb;i++)
+		{
+			pushNewObject<CLDevice>(L, ids[i]);
+			lua_rawseti(L, -2, i+1);
+		}
+		return 1;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLPlatform::GetDevices, "devices");
+	}
+private:
+	cl_platform_id Handle;
+};
+
+// Pushes a string info of an object, or returns NULL without pushing anything on failure
+template<class id_t, class get_info_t>
+static const char* push_info_string(lua_State* L, id_t id, cl_uint param, get_info_t get_info_fct)
+{
+	size_t size;
+	if(get_info_fct(id, param, 0, NULL, &size) != CL_SUCCESS)
+		return NULL;
+	char* str = (char*)lua_newuserdata(L, size + 1);
+	if(get_info_fct(id, param, size, str, NULL) != CL_SUCCESS)
+	{
+		lua_pop(L, 1);
+		return NULL;
+	}
+	str[size] = 0;
+	return str;
+}
+
+// Checks that the string field of the info table at idx matches value
+static bool info_matches(lua_State* L, int idx, const char* field, const char* value)
+{
+	lua_getfield(L, idx, "info");
+	lua_getfield(L, -1, field);
+	bool res = value && lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), value) == 0;
+	lua_pop(L, 2);
+	return res;
+}
+
+// Opens the device described by a snapshot entry, as loaded by cl.load_snapshot
+static cl_device_id resolve_device(lua_State* L, int idx)
+{
+	cl_uint nb;
+	int top = lua_gettop(L);
+	lua_getfield(L, idx, "platform");
+	lua_getfield(L, idx, "index");
+	cl_uint platform = (cl_uint)lua_tonumber(L, top+1), index = (cl_uint)lua_tonumber(L, top+2);
+	lua_settop(L, top);
+	error_check(L, clGetPlatformIDs(0, NULL, &nb));
+	if(platform < 1 || platform > nb)
+		luaL_error(L, "snapshot device does not exist anymore");
+	cl_platform_id* platforms = (cl_platform_id*)lua_newuserdata(L, nb * sizeof(cl_platform_id));
+	error_check(L, clGetPlatformIDs(nb, platforms, NULL));
+	error_check(L, clGetDeviceIDs(platforms[platform-1], CL_DEVICE_TYPE_ALL, 0, NULL, &nb));
+	if(index < 1 || index > nb)
+		luaL_error(L, "snapshot device does not exist anymore");
+	cl_device_id* devices = (cl_device_id*)lua_newuserdata(L, nb * sizeof(cl_device_id));
+	error_check(L, clGetDeviceIDs(platforms[platform-1], CL_DEVICE_TYPE_ALL, nb, devices, NULL));
+	if(!info_matches(L, idx, "name", push_info_string(L, devices[index-1], CL_DEVICE_NAME, clGetDeviceInfo)))
+		luaL_error(L, "snapshot device does not match the installed one");
+	cl_device_id device = devices[index-1];
+	lua_settop(L, top);
+	return device;
+}
+
+// Reads an optional table of device objects or snapshot devices into a scratch array left on the stack
+static cl_device_id* check_devices(lua_State* L, int idx, cl_uint* nb)
+{
+	*nb = 0;
+	if(lua_isnoneornil(L, idx))
+		return NULL;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	*nb = (cl_uint)lua_rawlen(L, idx);
+	cl_device_id* devices = (cl_device_id*)lua_newuserdata(L, *nb * sizeof(cl_device_id));
+	int top = lua_gettop(L);
+	for(cl_uint i=0;i<*nb;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		if(lua_type(L, top+1) == LUA_TTABLE)
+			devices[i] = resolve_device(L, top+1);
+		else
+			devices[i] = *(CLDevice*)CLObject::CheckObject(L, top+1, "device");
+		lua_settop(L, top);
+	}
+	return devices;
+}
+
+// Raises an error containing the build log of every device on which the build failed
+static void build_error(lua_State* L, cl_program program, cl_int err)
+{
+	cl_uint nb;
+	error_check(L, clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof nb, &nb, NULL));
+	cl_device_id* devices = (cl_device_id*)lua_newuserdata(L, nb * sizeof(cl_device_id));
+	error_check(L, clGetProgramInfo(program, CL_PROGRAM_DEVICES, nb * sizeof(cl_device_id), devices, NULL));
+	luaL_Buffer buf;
+	luaL_buffinit(L, &buf);
+	for(cl_uint i=0;i<nb;i++)
+	{
+		cl_build_status status;
+		size_t size;
+		if(clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_STATUS, sizeof status, &status, NULL) != CL_SUCCESS || status != CL_BUILD_ERROR)
+			continue;
+		if(clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &size) != CL_SUCCESS)
+			continue;
+		char* log = luaL_prepbuffsize(&buf, size);
+		if(clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, size, log, NULL) == CL_SUCCESS)
+			luaL_addsize(&buf, strlen(log));
+	}
+	luaL_pushresult(&buf);
+	luaL_error(L, "OpenCL: %s\n%s", error_string(err), lua_tostring(L, -1));
+}
+
+class CLEvent : public CLObject
+{
+public:
+	CLEvent(cl_event id) : Handle(id), HostData(false) {}
+	virtual void Retain() { clRetainEvent(Handle); }
+	virtual void Release() { clReleaseEvent(Handle); }
+	operator cl_event const() { return Handle; }
+	virtual const char* GetClassName() { return "event"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_EVENT, clGetEventInfo); }
+	int GetProfilingInfo(lua_State* L) { return push_info(L, Handle, IT_PROFILING, clGetEventProfilingInfo); }
+	int Wait(lua_State* L) { error_check(L, clWaitForEvents(1, &Handle)); return 0; }
+	// Cheaper than info() for polling
+	int GetStatus(lua_State* L)
+	{
+		cl_int status;
+		error_check(L, clGetEventInfo(Handle, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof status, &status, NULL));
+		if(status < 0)
+			lua_pushstring(L, error_string(status));
+		else
+			pushEnum<EBT_COMMAND_EXECUTION_STATUS>(L, &status, sizeof status);
+		return 1;
+	}
+	// Keeps the table on top of the stack alive until the command has completed
+	void Anchor(lua_State* L, int idx)
+	{
+		lua_setuservalue(L, idx);
+		HostData = true;
+	}
+	int Collect(lua_State* L)
+	{
+		// Host memory referenced by the command must not be freed before it has completed
+		if(HostData)
+			clWaitForEvents(1, &Handle);
+		Release();
+		return 0;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLEvent::GetProfilingInfo, "profiling_info");
+		AddMethod(L, (lua_method)&CLEvent::Wait, "wait");
+		AddMethod(L, (lua_method)&CLEvent::GetStatus, "status");
+		AddMethod(L, (lua_method)&CLEvent::Collect, "__gc");
+	}
+private:
+	cl_event Handle;
+	bool HostData;
+};
+
+class CLMem : public CLObject
+{
+public:
+	CLMem(cl_mem id) : Handle(id), Size(0) {}
+	virtual void Retain() { clRetainMemObject(Handle); }
+	virtual void Release() { clReleaseMemObject(Handle); }
+	operator cl_mem const() { return Handle; }
+	virtual const char* GetClassName() { return "buffer"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_MEM, clGetMemObjectInfo); }
+	size_t GetSize(lua_State* L)
+	{
+		if(Size == 0)
+			error_check(L, clGetMemObjectInfo(Handle, CL_MEM_SIZE, sizeof Size, &Size, NULL));
+		return Size;
+	}
+private:
+	cl_mem Handle;
+	size_t Size;
+};
+
+// Layout of kernel argument and buffer element types, following the OpenCL C alignment rules
+template<class T> static void store(lua_State* L, int idx, unsigned char* dst) { T x = (T)lua_tonumber(L, idx); memcpy(dst, &x, sizeof x); }
+// Integer types go through lua_Integer, which keeps 64-bit values exact when Lua has integers
+template<class T> static void storeInteger(lua_State* L, int idx, unsigned char* dst) 
+{ 
+	int isnum;
+	lua_Integer value = lua_tointegerx(L, idx, &isnum);
+	if(!isnum)
+		luaL_error(L, "number has no integer representation");
+	T x = (T)value; 
+	memcpy(dst, &x, sizeof x); 
+}
+template<class T> static void pushInteger(lua_State*L, const void* ptr, size_t size) { assert(size == sizeof(T)); lua_pushinteger(L, (lua_Integer)*(const T*)ptr); }
+
+struct scalar_type_t
+{
+	const char* name;
+	size_t size;
+	void (*storeFct)(lua_State* L, int idx, unsigned char* dst);
+	push_t pushFct;
+};
+
+static const scalar_type_t scalar_types[] = 
+{
+	{ "char",   sizeof(cl_char),   storeInteger<cl_char>,   pushInteger<cl_char> },
+	{ "uchar",  sizeof(cl_uchar),  storeInteger<cl_uchar>,  pushInteger<cl_uchar> },
+	{ "short",  sizeof(cl_short),  storeInteger<cl_short>,  pushInteger<cl_short> },
+	{ "ushort", sizeof(cl_ushort), storeInteger<cl_ushort>, pushInteger<cl_ushort> },
+	{ "int",    sizeof(cl_int),    storeInteger<cl_int>,    pushInteger<cl_int> },
+	{ "uint",   sizeof(cl_uint),   storeInteger<cl_uint>,   pushInteger<cl_uint> },
+	{ "long",   sizeof(cl_long),   storeInteger<cl_long>,   pushInteger<cl_long> },
+	{ "ulong",  sizeof(cl_ulong),  storeInteger<cl_ulong>,  pushInteger<cl_ulong> },
+	{ "float",  sizeof(cl_float),  store<cl_float>,         push<cl_float> },
+	{ "double", sizeof(cl_double), store<cl_double>,        push<cl_double> },
+};
+
+class CLStruct;
+struct type_t
+{
+	const scalar_type_t* scalar; // NULL for structures
+	int count;                   // Number of vector components, 1 for scalars
+	const CLStruct* sub;         // Structure layout, NULL for scalars and vectors
+	size_t size, alignment;
+};
+
+struct field_t
+{
+	type_t type;
+	const char* name;
+	size_t offset;
+};
+
+static size_t align_size(size_t size, size_t alignment) { return (size + alignment - 1) / alignment * alignment; }
+
+// Parses a type name such as "uint" or "float4"
+static bool parse_type_name(const char* name, type_t& type)
+{
+	static const char* const suffixes[] = { "", "2", "3", "4", "8", "16" };
+	size_t len = strcspn(name, "0123456789");
+	type.sub = NULL;
+	type.count = 0;
+	// The vector size must be exactly one of the OpenCL ones, without anything after it
+	for(size_t i=0;i<countof(suffixes);i++)
+		if(strcmp(name + len, suffixes[i]) == 0)
+			type.count = i ? atoi(suffixes[i]) : 1;
+	if(type.count == 0)
+		return false;
+	for(size_t i=0;i<countof(scalar_types);i++)
+	{
+		if(strlen(scalar_types[i].name) == len && strncmp(scalar_types[i].name, name, len) == 0)
+		{
+			type.scalar = scalar_types + i;
+			// 3-component vectors have the size and alignment of 4-component ones
+			type.size = type.alignment = type.scalar->size * (type.count == 3 ? 4 : type.count);
+			return true;
+		}
+	}
+	return false;
+}
+
+class CLStruct : public CLObject
+{
+public:
+	CLStruct(int nb_fields) : NbFields(nb_fields) {}
+	virtual const char* GetClassName() { return "struct"; }
+	virtual int GetInfo(lua_State* L)
+	{
+		lua_createtable(L, 0, 3);
+		lua_pushnumber(L, (lua_Number)Type.size);
+		lua_setfield(L, -2, "size");
+		lua_pushnumber(L, (lua_Number)Type.alignment);
+		lua_setfield(L, -2, "alignment");
+		lua_createtable(L, NbFields, 0);
+		for(int i=0;i<NbFields;i++)
+		{
+			lua_createtable(L, 0, 2);
+			lua_pushstring(L, Fields()[i].name);
+			lua_setfield(L, -2, "name");
+			lua_pushnumber(L, (lua_Number)Fields()[i].offset);
+			lua_setfield(L, -2, "offset");
+			lua_rawseti(L, -2, i+1);
+		}
+		lua_setfield(L, -2, "fields");
+		return 1;
+	}
+	const type_t& GetType() const { return Type; }
+	const field_t* Fields() const { return (const field_t*)(this + 1); }
+	// Accepts a type name or a structure layout. Nested layouts must be kept alive by the caller.
+	static void CheckType(lua_State* L, int idx, type_t& type)
+	{
+		CLStruct* st;
+		if(lua_type(L, idx) == LUA_TSTRING)
+		{
+			if(!parse_type_name(lua_tostring(L, idx), type))
+				luaL_error(L, "unknown type '%s'", lua_tostring(L, idx));
+		}
+		else if((st = (CLStruct*)TestObject(L, idx, "struct")))
+			type = st->Type;
+		else
+			luaL_error(L, "expected type name or struct layout");
+	}
+	// cl.type("float4") creates the layout of a scalar or vector type
+	static int NewType(lua_State* L)
+	{
+		type_t type;
+		CheckType(L, 1, type);
+		CLStruct* st = new(lua_newuserdata(L, sizeof(CLStruct))) CLStruct(0);
+		st->Type = type;
+		st->Register(L);
+		return 1;
+	}
+	// cl.struct{ {"pos", "float4"}, {"id", "uint"} } computes the offsets of the fields once
+	static int NewStruct(lua_State* L)
+	{
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_settop(L, 1);
+		int nb = (int)lua_rawlen(L, 1);
+		if(nb == 0)
+			luaL_error(L, "structure has no field");
+		size_t names_size = 0;
+		for(int i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, 1, i+1);
+			luaL_checktype(L, 2, LUA_TTABLE);
+			lua_rawgeti(L, 2, 1);
+			names_size += strlen(luaL_checkstring(L, 3)) + 1;
+			lua_settop(L, 1);
+		}
+		CLStruct* st = new(lua_newuserdata(L, sizeof(CLStruct) + nb * sizeof(field_t) + names_size)) CLStruct(nb);
+		field_t* fields = (field_t*)(st + 1);
+		char* names = (char*)(fields + nb);
+		// Nested layouts are kept alive by the user value
+		lua_createtable(L, nb, 0);
+		size_t offset = 0, alignment = 1;
+		for(int i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, 1, i+1);
+			lua_rawgeti(L, 4, 1);
+			lua_rawgeti(L, 4, 2);
+			CheckType(L, 6, fields[i].type);
+			lua_rawseti(L, 3, i+1);
+			strcpy(names, lua_tostring(L, 5));
+			fields[i].name = names;
+			names += strlen(names) + 1;
+			offset = align_size(offset, fields[i].type.alignment);
+			fields[i].offset = offset;
+			offset += fields[i].type.size;
+			if(fields[i].type.alignment > alignment)
+				alignment = fields[i].type.alignment;
+			lua_settop(L, 3);
+		}
+		lua_setuservalue(L, 2);
+		st->Type.scalar = NULL;
+		st->Type.count = 1;
+		st->Type.sub = st;
+		st->Type.alignment = alignment;
+		st->Type.size = align_size(offset, alignment);
+		st->Register(L);
+		return 1;
+	}
+	// Writes the Lua value at idx, using the layout of type
+	static void Pack(lua_State* L, const type_t& type, int idx, unsigned char* dst)
+	{
+		if(type.sub)
+		{
+			if(lua_type(L, idx) != LUA_TTABLE)
+				luaL_error(L, "expected table for structure value");
+			const field_t* fields = type.sub->Fields();
+			for(int i=0;i<type.sub->NbFields;i++)
+			{
+				lua_getfield(L, idx, fields[i].name);
+				if(lua_isnil(L, -1))
+					luaL_error(L, "missing field '%s'", fields[i].name);
+				Pack(L, fields[i].type, lua_gettop(L), dst + fields[i].offset);
+				lua_pop(L, 1);
+			}
+		}
+		else if(type.count == 1)
+		{
+			if(lua_type(L, idx) != LUA_TNUMBER)
+				luaL_error(L, "expected number for %s value", type.scalar->name);
+			type.scalar->storeFct(L, idx, dst);
+		}
+		else
+		{
+			if(lua_type(L, idx) != LUA_TTABLE || lua_rawlen(L, idx) != (size_t)type.count)
+				luaL_error(L, "expected table of %d numbers for %s%d value", type.count, type.scalar->name, type.count);
+			for(int i=0;i<type.count;i++)
+			{
+				lua_rawgeti(L, idx, i+1);
+				if(lua_type(L, -1) != LUA_TNUMBER)
+					luaL_error(L, "expected table of %d numbers for %s%d value", type.count, type.scalar->name, type.count);
+				type.scalar->storeFct(L, -1, dst + i * type.scalar->size);
+				lua_pop(L, 1);
+			}
+		}
+	}
+	static void Unpack(lua_State* L, const type_t& type, const unsigned char* src)
+	{
+		if(type.sub)
+		{
+			const field_t* fields = type.sub->Fields();
+			lua_createtable(L, 0, type.sub->NbFields);
+			for(int i=0;i<type.sub->NbFields;i++)
+			{
+				Unpack(L, fields[i].type, src + fields[i].offset);
+				lua_setfield(L, -2, fields[i].name);
+			}
+		}
+		else if(type.count == 1)
+			type.scalar->pushFct(L, src, type.scalar->size);
+		else
+		{
+			lua_createtable(L, type.count, 0);
+			for(int i=0;i<type.count;i++)
+			{
+				type.scalar->pushFct(L, src + i * type.scalar->size, type.scalar->size);
+				lua_rawseti(L, -2, i+1);
+			}
+		}
+	}
+	// Values are arrays of elements when their first item is a table, or for scalars when they are tables
+	static bool IsArray(lua_State* L, const type_t& type, int idx)
+	{
+		if(lua_type(L, idx) != LUA_TTABLE)
+			return false;
+		if(type.sub)
+			return lua_rawlen(L, idx) > 0;
+		if(type.count == 1)
+			return true;
+		lua_rawgeti(L, idx, 1);
+		bool array = lua_type(L, -1) == LUA_TTABLE;
+		lua_pop(L, 1);
+		return array;
+	}
+	static size_t CountValues(lua_State* L, const type_t& type, int idx) { return IsArray(L, type, idx) ? lua_rawlen(L, idx) : 1; }
+	// Writes the value or array of values at idx, padding included, into CountValues() elements at dst
+	static void PackValues(lua_State* L, const type_t& type, int idx, unsigned char* dst)
+	{
+		size_t nb = CountValues(L, type, idx);
+		memset(dst, 0, nb * type.size);
+		if(!IsArray(L, type, idx))
+			Pack(L, type, idx, dst);
+		else
+			for(size_t i=0;i<nb;i++)
+			{
+				lua_rawgeti(L, idx, (int)i+1);
+				Pack(L, type, lua_gettop(L), dst + i * type.size);
+				lua_pop(L, 1);
+			}
+	}
+	// Size of the table at data_idx packed with the layout at layout_idx, or 0 if there is nothing to pack
+	static size_t PackedSize(lua_State* L, int data_idx, int layout_idx)
+	{
+		type_t type;
+		if(lua_type(L, data_idx) != LUA_TTABLE || lua_isnoneornil(L, layout_idx))
+			return 0;
+		CheckType(L, layout_idx, type);
+		return CountValues(L, type, data_idx) * type.size;
+	}
+	// layout:pack(value) returns the binary representation of a value, or of an array of values
+	int PackString(lua_State* L)
+	{
+		luaL_checkany(L, 1);
+		size_t size = CountValues(L, Type, 1) * Type.size;
+		luaL_Buffer buf;
+		PackValues(L, Type, 1, (unsigned char*)luaL_buffinitsize(L, &buf, size));
+		luaL_pushresultsize(&buf, size);
+		return 1;
+	}
+	// layout:unpack(data, index) returns the element at index, or the array of all elements
+	int UnpackString(lua_State* L)
+	{
+		size_t len;
+		const unsigned char* src = (const unsigned char*)luaL_checklstring(L, 1, &len);
+		size_t nb = len / Type.size;
+		if(lua_isnoneornil(L, 2))
+		{
+			lua_createtable(L, (int)nb, 0);
+			for(size_t i=0;i<nb;i++)
+			{
+				Unpack(L, Type, src + i * Type.size);
+				lua_rawseti(L, -2, (int)i+1);
+			}
+			return 1;
+		}
+		size_t index = (size_t)luaL_checknumber(L, 2);
+		if(index < 1 || index > nb)
+			luaL_error(L, "index %d out of range", (int)index);
+		Unpack(L, Type, src + (index-1) * Type.size);
+		return 1;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLStruct::PackString, "pack");
+		AddMethod(L, (lua_method)&CLStruct::UnpackString, "unpack");
+	}
+private:
+	type_t Type;
+	int NbFields;
+};
+
+#ifdef CL_VERSION_2_0
+// Shared virtual memory allocation, seen from Lua as an array of elements of a given layout.
+// The allocation is freed with the object. Events of the commands using it keep it referenced
+// until they have completed, and so do the kernels given it by svm_pointers.
+class CLSvm : public CLObject
+{
+public:
+	CLSvm(cl_context context, void* ptr, size_t size, bool fine_grain, const type_t& type) 
+		: Context(context), Ptr(ptr), Size(size), FineGrain(fine_grain), Mapped(false), Type(type) {}
+	virtual void Retain() { clRetainContext(Context); }
+	virtual void Release() { clSVMFree(Context, Ptr); clReleaseContext(Context); }
+	virtual const char* GetClassName() { return "svm"; }
+	virtual int GetInfo(lua_State* L)
+	{
+		lua_createtable(L, 0, 4);
+		lua_pushnumber(L, (lua_Number)Size);
+		lua_setfield(L, -2, "size");
+		lua_pushnumber(L, (lua_Number)(Size / Type.size));
+		lua_setfield(L, -2, "count");
+		lua_pushboolean(L, FineGrain);
+		lua_setfield(L, -2, "fine_grain");
+		lua_pushboolean(L, Mapped);
+		lua_setfield(L, -2, "mapped");
+		return 1;
+	}
+	void* GetPointer() const { return Ptr; }
+	size_t GetSize() const { return Size; }
+	void SetMapped(bool mapped) { Mapped = mapped; }
+	void CheckAccess(lua_State* L)
+	{
+		if(!FineGrain && !Mapped)
+			luaL_error(L, "coarse-grained SVM buffer must be mapped for host access");
+	}
+	// Returns the element pointed to by the number at idx, or NULL when out of range or not an integer
+	unsigned char* Element(lua_State* L, int idx)
+	{
+		lua_Number index = lua_tonumber(L, idx);
+		// Written so that NaN is rejected
+		if(!(index >= 1 && index <= Size / Type.size) || index != (lua_Number)(size_t)index)
+			return NULL;
+		return (unsigned char*)Ptr + ((size_t)index - 1) * Type.size;
+	}
+	static int Index(lua_State* L)
+	{
+		if(lua_type(L, 2) != LUA_TNUMBER)
+		{
+			lua_getmetatable(L, 1);
+			lua_pushvalue(L, 2);
+			lua_rawget(L, -2);
+			return 1;
+		}
+		CLSvm* svm = (CLSvm*)lua_touserdata(L, 1);
+		unsigned char* ptr = svm->Element(L, 2);
+		if(!ptr)
+			return 0;
+		svm->CheckAccess(L);
+		CLStruct::Unpack(L, svm->Type, ptr);
+		return 1;
+	}
+	static int NewIndex(lua_State* L)
+	{
+		CLSvm* svm = (CLSvm*)lua_touserdata(L, 1);
+		unsigned char* ptr = lua_type(L, 2) == LUA_TNUMBER ? svm->Element(L, 2) : NULL;
+		if(!ptr)
+			luaL_error(L, "invalid SVM buffer index");
+		svm->CheckAccess(L);
+		CLStruct::Pack(L, svm->Type, 3, ptr);
+		return 0;
+	}
+	int Len(lua_State* L)
+	{
+		lua_pushnumber(L, (lua_Number)(Size / Type.size));
+		return 1;
+	}
+	// svm:get(offset, size) returns the content as a string
+	int Get(lua_State* L)
+	{
+		size_t offset = (size_t)luaL_optnumber(L, 1, 0);
+		size_t size = offset < Size ? (size_t)luaL_optnumber(L, 2, (lua_Number)(Size - offset)) : 0;
+		if(offset > Size || size > Size - offset)
+			luaL_error(L, "range exceeds SVM buffer size");
+		CheckAccess(L);
+		lua_pushlstring(L, (const char*)Ptr + offset, size);
+		return 1;
+	}
+	// svm:set(data, offset) copies a string into the buffer
+	int Set(lua_State* L)
+	{
+		size_t size;
+		const char* data = luaL_checklstring(L, 1, &size);
+		size_t offset = (size_t)luaL_optnumber(L, 2, 0);
+		if(offset > Size || size > Size - offset)
+			luaL_error(L, "range exceeds SVM buffer size");
+		CheckAccess(L);
+		memcpy((char*)Ptr + offset, data, size);
+		return 0;
+	}
+	// svm:address(index) is the address of an element, to be stored in other SVM structures,
+	// in a "ulong" or "uint" field depending on the address_bits of the device
+	int Address(lua_State* L)
+	{
+		unsigned char* ptr = Element(L, 1);
+		if(!ptr)
+			luaL_error(L, "invalid SVM buffer index");
+		lua_pushinteger(L, (lua_Integer)(size_t)ptr);
+		return 1;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLSvm::Get, "get");
+		AddMethod(L, (lua_method)&CLSvm::Set, "set");
+		AddMethod(L, (lua_method)&CLSvm::Address, "address");
+		AddMethod(L, (lua_method)&CLSvm::Len, "__len");
+		lua_pushcfunction(L, Index);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, NewIndex);
+		lua_setfield(L, -2, "__newindex");
+	}
+private:
+	cl_context Context;
+	void* Ptr;
+	size_t Size;
+	bool FineGrain, Mapped;
+	type_t Type;
+};
+#endif
+
+class CLKernel : public CLObject
+{
+public:
+	CLKernel(cl_kernel id) : Handle(id), NumArgs((cl_uint)-1), ArgTypes(NULL), NbArgTypes(0), PackedSize(0), HasSvmPointers(false), Anchored(false) {}
+	virtual void Retain() { clRetainKernel(Handle); }
+	virtual void Release() { clReleaseKernel(Handle); }
+	operator cl_kernel const() { return Handle; }
+	virtual const char* GetClassName() { return "kernel"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_KERNEL, clGetKernelInfo); }
+	int GetWorkGroupInfo(lua_State* L)
+	{
+		CLDevice* dev = (CLDevice*)CheckObject(L, 1, "device");
+		return push_info(L, Handle, IT_WORKGROUP, clGetKernelWorkGroupInfo, (cl_device_id)*dev);
+	}
+#ifdef CL_VERSION_1_2
+	int GetArgInfo(lua_State* L)
+	{
+		cl_uint index = (cl_uint)luaL_checknumber(L, 1);
+		return push_info(L, Handle, IT_KERNEL_ARG, clGetKernelArgInfo, index);
+	}
+#endif
+	cl_uint GetNumArgs(lua_State* L)
+	{
+		if(NumArgs == (cl_uint)-1)
+			error_check(L, clGetKernelInfo(Handle, CL_KERNEL_NUM_ARGS, sizeof NumArgs, &NumArgs, NULL));
+		return NumArgs;
+	}
+	// kernel:signature{ "buffer", "float4", layout, ... } gives the types of the arguments, so that
+	// numbers and tables passed for them are packed in C. "buffer" or false leave an argument untyped.
+	int SetSignature(lua_State* L)
+	{
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_settop(L, 1);
+		cl_uint nb = (cl_uint)lua_rawlen(L, 1);
+		if(nb > GetNumArgs(L))
+			luaL_error(L, "signature has more arguments than the kernel");
+		type_t* types = (type_t*)lua_newuserdata(L, nb * sizeof(type_t));
+		// The layouts are kept alive by the registry, as long as this object exists
+		lua_createtable(L, nb+1, 0);
+		lua_pushvalue(L, 2);
+		lua_rawseti(L, 3, 1);
+		size_t size = 0;
+		for(cl_uint i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, 1, i+1);
+			types[i].scalar = NULL;
+			types[i].sub = NULL;
+			types[i].size = 0;
+			if(lua_toboolean(L, 4) && !(lua_type(L, 4) == LUA_TSTRING && strcmp(lua_tostring(L, 4), "buffer") == 0))
+				CLStruct::CheckType(L, 4, types[i]);
+			size += types[i].size;
+			lua_rawseti(L, 3, i+2);
+		}
+		Anchor(L, ANCHOR_SIGNATURE);
+		ArgTypes = types;
+		NbArgTypes = nb;
+		PackedSize = size;
+		return 0;
+	}
+#ifdef CL_VERSION_2_0
+	// kernel:svm_pointers{ svm, ... } declares the SVM buffers reached through pointers stored in other ones
+	int SetSvmPointers(lua_State* L)
+	{
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_settop(L, 1);
+		size_t nb = lua_rawlen(L, 1);
+		void** ptrs = (void**)lua_newuserdata(L, nb * sizeof(void*));
+		// The buffers are kept alive by the registry, since the kernel keeps their pointers
+		lua_createtable(L, (int)nb, 0);
+		for(size_t i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, 1, (int)i+1);
+			ptrs[i] = ((CLSvm*)CheckObject(L, 4, "svm"))->GetPointer();
+			lua_rawseti(L, 3, (int)i+1);
+		}
+		error_check(L, clSetKernelExecInfo(Handle, CL_KERNEL_EXEC_INFO_SVM_PTRS, nb * sizeof(void*), ptrs));
+		Anchor(L, ANCHOR_SVM_POINTERS);
+		HasSvmPointers = nb > 0;
+		return 0;
+	}
+#endif
+	// Type of an argument, or NULL when it has not been given by the signature
+	const type_t* GetArgType(cl_uint index) { return index < NbArgTypes && ArgTypes[index].size ? ArgTypes + index : NULL; }
+	size_t GetPackedSize() { return PackedSize; }
+	bool GetHasSvmPointers() { return HasSvmPointers; }
+	int Collect(lua_State* L)
+	{
+		if(Anchored)
+		{
+			lua_pushnil(L);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+		}
+		Release();
+		return 0;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLKernel::SetSignature, "signature");
+		AddMethod(L, (lua_method)&CLKernel::Collect, "__gc");
+#ifdef CL_VERSION_2_0
+		AddMethod(L, (lua_method)&CLKernel::SetSvmPointers, "svm_pointers");
+#endif
+		AddMethod(L, (lua_method)&CLKernel::GetWorkGroupInfo, "workgroup_info");
+#ifdef CL_VERSION_1_2
+		AddMethod(L, (lua_method)&CLKernel::GetArgInfo, "arg_info");
+#endif
+	}
+private:
+	enum { ANCHOR_SIGNATURE = 1, ANCHOR_SVM_POINTERS };
+	// Stores the value on top of the stack in the slot of the registry entry of this object
+	void Anchor(lua_State* L, int slot)
+	{
+		lua_rawgetp(L, LUA_REGISTRYINDEX, this);
+		if(lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, 2, 0);
+			lua_pushvalue(L, -1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+		}
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, slot);
+		lua_pop(L, 1);
+		Anchored = true;
+	}
+	cl_kernel Handle;
+	cl_uint NumArgs;
+	const type_t* ArgTypes;
+	cl_uint NbArgTypes;
+	size_t PackedSize;
+	bool HasSvmPointers, Anchored;
+};
+
+#ifdef CL_VERSION_1_1
+// Builds programs on a few worker threads, and completes the user event of each program when its build is over
+class CLBuildPool : public CLObject
+{
+public:
+	CLBuildPool(const char* options, cl_uint nb, const cl_device_id* devices) 
+		: Options(options ? options : ""), HasOptions(options != NULL), Devices(devices, devices + nb), Next(0) {}
+	virtual const char* GetClassName() { return "build pool"; }
+	virtual int GetInfo(lua_State* L) { return 0; }
+	// Pushes an event which completes when the build of the program is over.
+	// The event keeps the pool alive, so that it is not joined before the builds are over.
+	void AddProgram(lua_State* L, cl_program program, int pool_idx)
+	{
+		cl_int err;
+		cl_context context;
+		error_check(L, clGetProgramInfo(program, CL_PROGRAM_CONTEXT, sizeof context, &context, NULL));
+		cl_event event = clCreateUserEvent(context, &err);
+		error_check(L, err);
+		pushNewObject<CLEvent>(L, event)->Release();
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, pool_idx);
+		lua_rawseti(L, -2, 1);
+		lua_setuservalue(L, -2);
+		job_t job = { program, event };
+		Jobs.push_back(job);
+		clRetainProgram(program);
+		clRetainEvent(event);
+	}
+	void Start()
+	{
+		size_t nb = std::min<size_t>(Jobs.size(), std::max(1u, std::thread::hardware_concurrency()));
+		try
+		{
+			Threads.reserve(nb);
+			for(size_t i=0;i<nb;i++)
+				Threads.push_back(std::thread(&CLBuildPool::Run, this));
+		}
+		catch(...) {}
+		// Without any worker thread, the builds run synchronously
+		if(Threads.empty())
+			Run();
+	}
+	int Collect(lua_State* L)
+	{
+		for(size_t i=0;i<Threads.size();i++)
+			Threads[i].join();
+		for(size_t i=0;i<Jobs.size();i++)
+		{
+			// Builds which never started must not leave their events pending
+			if(i >= Next)
+				clSetUserEventStatus(Jobs[i].Event, CL_INVALID_OPERATION);
+			clReleaseProgram(Jobs[i].Program);
+			clReleaseEvent(Jobs[i].Event);
+		}
+		this->~CLBuildPool();
+		return 0;
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLBuildPool::Collect, "__gc");
+	}
+private:
+	// clBuildProgram is thread safe since OpenCL 1.1
+	void Run()
+	{
+		for(size_t i; (i = Next++) < Jobs.size();)
+		{
+			cl_int err = clBuildProgram(Jobs[i].Program, (cl_uint)Devices.size(), Devices.empty() ? NULL : &Devices[0], 
+				HasOptions ? Options.c_str() : NULL, NULL, NULL);
+			// A build failure is reported by the build_status field of build_info, other errors by the event status
+			clSetUserEventStatus(Jobs[i].Event, err == CL_SUCCESS || err == CL_BUILD_PROGRAM_FAILURE ? CL_COMPLETE : err);
+		}
+	}
+	struct job_t
+	{
+		cl_program Program;
+		cl_event Event;
+	};
+	std::string Options;
+	bool HasOptions;
+	std::vector<cl_device_id> Devices;
+	std::vector<job_t> Jobs;
+	std::vector<std::thread> Threads;
+	std::atomic<size_t> Next;
+};
+
+// Pushes a new build pool, which is started once all its programs are added
+static CLBuildPool* push_build_pool(lua_State* L, const char* options, cl_uint nb, const cl_device_id* devices)
+{
+	CLBuildPool* pool = new(lua_newuserdata(L, sizeof(CLBuildPool))) CLBuildPool(options, nb, devices);
+	pool->Register(L);
+	return pool;
+}
+#endif
+
+class CLProgram : public CLObject
+{
+public:
+	CLProgram(cl_program id) : Handle(id) {}
+	virtual void Retain() { clRetainProgram(Handle); }
+	virtual void Release() { clReleaseProgram(Handle); }
+	operator cl_program const() { return Handle; }
+	virtual const char* GetClassName() { return "program"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_PROGRAM, clGetProgramInfo); }
+	int GetBuildInfo(lua_State* L)
+	{
+		CLDevice* dev = (CLDevice*)CheckObject(L, 1, "device");
+		return push_info(L, Handle, IT_PROGRAM_BUILD, clGetProgramBuildInfo, (cl_device_id)*dev);
+	}
+	int Build(lua_State* L)
+	{
+		cl_uint nb;
+		const char* options = luaL_optstring(L, 1, NULL);
+		cl_device_id* devices = check_devices(L, 2, &nb);
+		cl_int err = clBuildProgram(Handle, nb, devices, options, NULL, NULL);
+		if(err == CL_BUILD_PROGRAM_FAILURE)
+			build_error(L, Handle, err);
+		error_check(L, err);
+		return 0;
+	}
+#ifdef CL_VERSION_1_1
+	int BuildAsync(lua_State* L)
+	{
+		cl_uint nb;
+		lua_settop(L, 2);
+		const char* options = luaL_optstring(L, 1, NULL);
+		cl_device_id* devices = check_devices(L, 2, &nb);
+		// Starts building the program and pushes an event which completes when the build is over.
+		// Success or failure is then reported by the build_status field of build_info.
+		CLBuildPool* pool = push_build_pool(L, options, nb, devices);
+		pool->AddProgram(L, Handle, lua_gettop(L));
+		pool->Start();
+		return 1;
+	}
+#endif
+	int CreateKernel(lua_State* L)
+	{
+		cl_int err;
+		cl_kernel kernel = clCreateKernel(Handle, luaL_checkstring(L, 1), &err);
+		error_check(L, err);
+		pushNewObject<CLKernel>(L, kernel)->Release();
+		return 1;
+	}
+	// Binaries cannot go through push_info, because the caller has to allocate them
+	int GetBinaries(lua_State* L)
+	{
+		cl_uint nb;
+		error_check(L, clGetProgramInfo(Handle, CL_PROGRAM_NUM_DEVICES, sizeof nb, &nb, NULL));
+		size_t* sizes = (size_t*)lua_newuserdata(L, nb * sizeof(size_t));
+		unsigned char** binaries = (unsigned char**)lua_newuserdata(L, nb * sizeof(unsigned char*));
+		error_check(L, clGetProgramInfo(Handle, CL_PROGRAM_BINARY_SIZES, nb * sizeof(size_t), sizes, NULL));
+		for(cl_uint i=0;i<nb;i++)
+			binaries[i] = (unsigned char*)lua_newuserdata(L, sizes[i]);
+		error_check(L, clGetProgramInfo(Handle, CL_PROGRAM_BINARIES, nb * sizeof(unsigned char*), binaries, NULL));
+		lua_createtable(L, nb, 0);
+		for(cl_uint i=0;i<nb;i++)
+		{
+			lua_pushlstring(L, (const char*)binaries[i], sizes[i]);
+			lua_rawseti(L, -2, i+1);
+		}
+		return 1;
+	}
+#ifdef CL_VERSION_1_2
+	// program:compile(options, headers, devices), where headers maps include names to header programs
+	int Compile(lua_State* L)
+	{
+		cl_uint nb, nb_headers = 0;
+		lua_settop(L, 3);
+		const char* options = luaL_optstring(L, 1, NULL);
+		check_type(L, 2, 1<<LUA_TTABLE|1<<LUA_TNIL);
+		cl_device_id* devices = check_devices(L, 3, &nb);
+		if(lua_type(L, 2) == LUA_TTABLE)
+			for(lua_pushnil(L); lua_next(L, 2); lua_pop(L, 1))
+				nb_headers++;
+		cl_program* headers = (cl_program*)lua_newuserdata(L, nb_headers * sizeof(cl_program));
+		const char** names = (const char**)lua_newuserdata(L, nb_headers * sizeof(const char*));
+		if(nb_headers)
+		{
+			int top = lua_gettop(L);
+			cl_uint i = 0;
+			for(lua_pushnil(L); lua_next(L, 2); lua_settop(L, top+1))
+			{
+				if(lua_type(L, top+1) != LUA_TSTRING)
+					luaL_error(L, "header names must be strings");
+				// The names stay referenced by the table
+				names[i] = lua_tostring(L, top+1);
+				headers[i++] = *(CLProgram*)CheckObject(L, top+2, "program");
+			}
+		}
+		cl_int err = clCompileProgram(Handle, nb, devices, options, nb_headers, headers, names, NULL, NULL);
+		if(err == CL_COMPILE_PROGRAM_FAILURE)
+			build_error(L, Handle, err);
+		error_check(L, err);
+		return 0;
+	}
+#endif
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLProgram::GetBuildInfo, "build_info");
+		AddMethod(L, (lua_method)&CLProgram::Build, "build");
+#ifdef CL_VERSION_1_1
+		AddMethod(L, (lua_method)&CLProgram::BuildAsync, "build_async");
+#endif
+		AddMethod(L, (lua_method)&CLProgram::CreateKernel, "kernel");
+		AddMethod(L, (lua_method)&CLProgram::GetBinaries, "binaries");
+#ifdef CL_VERSION_1_2
+		AddMethod(L, (lua_method)&CLProgram::Compile, "compile");
+#endif
+	}
+private:
+	cl_program Handle;
+};
+
+// Commands accepted by the queue methods and by queue:submit
+enum eCommand { CMD_WRITE, CMD_READ, CMD_KERNEL, CMD_MAX };
+static const char* const command_names[CMD_MAX] = { "write", "read", "kernel" };
+
+struct kernel_arg_t
+{
+	size_t size;
+	const void* value; // NULL when the argument is a memory object
+	cl_mem mem;
+	void* svm;         // Set when the argument is a SVM pointer
+};
+
+struct command_t
+{
+	eCommand type;
+	cl_mem mem;
+	size_t offset, size;
+	size_t max_size;  // Size a write can be given on replay, up to the end of the buffer
+	const void* data; // Source of a write, destination of a read
+	cl_kernel kernel;
+	cl_uint work_dim;
+	size_t global[3], local[3];
+	bool has_local;
+	kernel_arg_t* args;
+	cl_uint nb_args;
+	bool uses_svm; // The SVM buffers used by the kernel must stay alive until it has completed
+};
+
+// cmd_index is the position of the command inside a batch, or 0 for a direct method call
+static void command_error(lua_State* L, int cmd_index, int idx, const char* msg)
+{
+	if(cmd_index)
+		luaL_error(L, "command %d, entry %d: %s", cmd_index, idx, msg);
+	luaL_error(L, "argument %d: %s", idx, msg);
+}
+
+static eCommand check_command_type(lua_State* L, int idx, int cmd_index)
+{
+	const char* name = lua_tostring(L, idx);
+	if(name)
+		for(int i=0;i<CMD_MAX;i++)
+			if(strcmp(command_names[i], name) == 0)
+				return (eCommand)i;
+	command_error(L, cmd_index, 1, "unknown command");
+	return CMD_MAX;
+}
+
+static cl_uint check_work_size(lua_State* L, int idx, size_t* sizes, int cmd_index, int pos)
+{
+	if(lua_type(L, idx) == LUA_TNUMBER)
+	{
+		sizes[0] = (size_t)lua_tonumber(L, idx);
+		return 1;
+	}
+	if(lua_type(L, idx) != LUA_TTABLE)
+		command_error(L, cmd_index, pos, "expected number or table for work size");
+	size_t nb = lua_rawlen(L, idx);
+	if(nb < 1 || nb > 3)
+		command_error(L, cmd_index, pos, "work size must have 1 to 3 dimensions");
+	for(size_t i=0;i<nb;i++)
+	{
+		lua_rawgeti(L, idx, (int)i+1);
+		if(lua_type(L, -1) != LUA_TNUMBER)
+			command_error(L, cmd_index, pos, "work size dimensions must be numbers");
+		sizes[i] = (size_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	return (cl_uint)nb;
+}
+
+static void check_range(lua_State* L, CLMem* mem, size_t offset, size_t size, int cmd_index, int pos)
+{
+	size_t mem_size = mem->GetSize(L);
+	if(offset > mem_size || size > mem_size - offset)
+		command_error(L, cmd_index, pos, "range exceeds buffer size");
+}
+
+// Validates the operands of a command found at stack indices base .. base+nb-1.
+// All pointers stored in cmd remain valid as long as these stack values are alive.
+// Typed kernel arguments and written tables are packed at *scratch, which is then advanced past them.
+static void check_command(lua_State* L, int base, int nb, command_t& cmd, kernel_arg_t* args, unsigned char** scratch, int cmd_index)
+{
+	// Positions reported in errors are relative to the command entry, or to the method arguments
+	int pos = cmd_index ? 2 : base;
+	CLMem* mem;
+	CLKernel* kernel;
+#ifdef CL_VERSION_2_0
+	CLSvm* svm;
+#endif
+	cmd.uses_svm = false;
+	switch(cmd.type)
+	{
+	case CMD_WRITE:
+		if(!(mem = (CLMem*)CLObject::TestObject(L, base, "buffer")))
+			command_error(L, cmd_index, pos, "expected buffer object");
+		cmd.mem = *mem;
+		cmd.offset = nb > 2 ? (size_t)luaL_optnumber(L, base+2, 0) : 0;
+		if(nb > 3 && lua_type(L, base+1) == LUA_TTABLE && !lua_isnil(L, base+3))
+		{
+			// Tables are packed at *scratch with the layout following the offset
+			type_t type;
+			CLStruct::CheckType(L, base+3, type);
+			cmd.size = CLStruct::CountValues(L, type, base+1) * type.size;
+			CLStruct::PackValues(L, type, base+1, *scratch);
+			cmd.data = *scratch;
+			*scratch += cmd.size;
+		}
+		else if(nb < 2 || lua_type(L, base+1) != LUA_TSTRING)
+			command_error(L, cmd_index, pos+1, "expected string data, or table and layout");
+		else
+			cmd.data = lua_tolstring(L, base+1, &cmd.size);
+		check_range(L, mem, cmd.offset, cmd.size, cmd_index, pos+2);
+		cmd.max_size = mem->GetSize(L) - cmd.offset;
+		break;
+	case CMD_READ:
+		if(!(mem = (CLMem*)CLObject::TestObject(L, base, "buffer")))
+			command_error(L, cmd_index, pos, "expected buffer object");
+		cmd.mem = *mem;
+		cmd.data = NULL;
+		cmd.offset = nb > 1 ? (size_t)luaL_optnumber(L, base+1, 0) : 0;
+		if(cmd.offset > mem->GetSize(L))
+			command_error(L, cmd_index, pos+1, "offset exceeds buffer size");
+		cmd.size = nb > 2 && !lua_isnil(L, base+2) ? (size_t)luaL_checknumber(L, base+2) : mem->GetSize(L) - cmd.offset;
+		check_range(L, mem, cmd.offset, cmd.size, cmd_index, pos+2);
+		break;
+	case CMD_KERNEL:
+		if(!(kernel = (CLKernel*)CLObject::TestObject(L, base, "kernel")))
+			command_error(L, cmd_index, pos, "expected kernel object");
+		if(nb < 2)
+			command_error(L, cmd_index, pos+1, "expected global work size");
+		cmd.kernel = *kernel;
+		cmd.work_dim = check_work_size(L, base+1, cmd.global, cmd_index, pos+1);
+		cmd.has_local = nb > 2 && !lua_isnil(L, base+2);
+		if(cmd.has_local && check_work_size(L, base+2, cmd.local, cmd_index, pos+2) != cmd.work_dim)
+			command_error(L, cmd_index, pos+2, "local and global work sizes have different dimensions");
+		cmd.args = args;
+		cmd.nb_args = nb > 3 ? nb - 3 : 0;
+#ifdef CL_VERSION_2_0
+		cmd.uses_svm = kernel->GetHasSvmPointers();
+#endif
+		if(cmd.nb_args > kernel->GetNumArgs(L))
+			command_error(L, cmd_index, pos+3, "too many kernel arguments");
+		for(cl_uint i=0;i<cmd.nb_args;i++)
+		{
+			int idx = base + 3 + i;
+			const type_t* type = kernel->GetArgType(i);
+			if(type && (lua_type(L, idx) == LUA_TNUMBER || lua_type(L, idx) == LUA_TTABLE))
+			{
+				memset(*scratch, 0, type->size);
+				CLStruct::Pack(L, *type, idx, *scratch);
+				args[i].value = *scratch;
+				args[i].size = type->size;
+				*scratch += type->size;
+			}
+			else if(lua_type(L, idx) == LUA_TSTRING)
+				args[i].value = lua_tolstring(L, idx, &args[i].size);
+			else if((mem = (CLMem*)CLObject::TestObject(L, idx, "buffer")))
+			{
+				args[i].value = NULL;
+				args[i].size = sizeof(cl_mem);
+				args[i].mem = *mem;
+			}
+#ifdef CL_VERSION_2_0
+			else if((svm = (CLSvm*)CLObject::TestObject(L, idx, "svm")))
+			{
+				args[i].value = NULL;
+				args[i].size = 0;
+				args[i].svm = svm->GetPointer();
+				cmd.uses_svm = true;
+				continue;
+			}
+#endif
+			else
+				command_error(L, cmd_index, pos+3+i, type ? "expected memory object, string, number or table for kernel argument" : "expected memory object or string for untyped kernel argument");
+			args[i].svm = NULL;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// Only calls into OpenCL, so that batches can be issued in a tight loop
+static cl_int issue_command(cl_command_queue queue, const command_t& cmd, cl_uint nb_wait, const cl_event* wait, cl_event* event)
+{
+	switch(cmd.type)
+	{
+	case CMD_WRITE:
+		return clEnqueueWriteBuffer(queue, cmd.mem, CL_FALSE, cmd.offset, cmd.size, cmd.data, nb_wait, wait, event);
+	case CMD_READ:
+		return clEnqueueReadBuffer(queue, cmd.mem, CL_FALSE, cmd.offset, cmd.size, (void*)cmd.data, nb_wait, wait, event);
+	case CMD_KERNEL:
+		for(cl_uint i=0;i<cmd.nb_args;i++)
+		{
+			const kernel_arg_t& arg = cmd.args[i];
+			cl_int err;
+#ifdef CL_VERSION_2_0
+			if(arg.svm)
+				err = clSetKernelArgSVMPointer(cmd.kernel, i, arg.svm);
+			else
+#endif
+			err = clSetKernelArg(cmd.kernel, i, arg.size, arg.value ? arg.value : &arg.mem);
+			if(err != CL_SUCCESS)
+				return err;
+		}
+		return clEnqueueNDRangeKernel(queue, cmd.kernel, cmd.work_dim, NULL, cmd.global, cmd.has_local ? cmd.local : NULL, nb_wait, wait, event);
+	default:
+		return CL_INVALID_OPERATION;
+	}
+}
+
+// Memory mapped files, used to stream files to and from buffers without going through Lua strings
+#define FILE_CHUNK_SIZE (32*1024*1024)
+
+struct file_t
+{
+#ifdef _WIN32
+	HANDLE File, Mapping;
+#else
+	int Fd;
+#endif
+	bool Write;
+};
+
+static const char* file_error()
+{
+#ifdef _WIN32
+	static char msg[256];
+	FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), 0, msg, sizeof msg, NULL);
+	return msg;
+#else
+	return strerror(errno);
+#endif
+}
+
+static size_t file_granularity()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// The file is created when opened for writing. Returns false on failure.
+static bool file_open(file_t& f, const char* path, bool write)
+{
+	f.Write = write;
+#ifdef _WIN32
+	f.Mapping = NULL;
+	f.File = CreateFileA(path, write ? GENERIC_READ|GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL, 
+		write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	return f.File != INVALID_HANDLE_VALUE;
+#else
+	f.Fd = open(path, write ? O_RDWR|O_CREAT : O_RDONLY, 0666);
+	return f.Fd >= 0;
+#endif
+}
+
+static bool file_size(file_t& f, cl_ulong* size)
+{
+#ifdef _WIN32
+	LARGE_INTEGER li;
+	if(!GetFileSizeEx(f.File, &li))
+		return false;
+	*size = (cl_ulong)li.QuadPart;
+#else
+	struct stat st;
+	if(fstat(f.Fd, &st))
+		return false;
+	*size = (cl_ulong)st.st_size;
+#endif
+	return true;
+}
+
+// Must be called once before mapping, after the file has its final size
+static bool file_prepare(file_t& f, cl_ulong size)
+{
+	cl_ulong cur_size;
+	if(!file_size(f, &cur_size))
+		return false;
+#ifdef _WIN32
+	if(f.Write && size > cur_size)
+	{
+		LARGE_INTEGER li;
+		li.QuadPart = (LONGLONG)size;
+		if(!SetFilePointerEx(f.File, li, NULL, FILE_BEGIN) || !SetEndOfFile(f.File))
+			return false;
+	}
+	f.Mapping = CreateFileMappingA(f.File, NULL, f.Write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+	return f.Mapping != NULL;
+#else
+	if(f.Write && size > cur_size)
+		return ftruncate(f.Fd, (off_t)size) == 0;
+	return true;
+#endif
+}
+
+// offset must be a multiple of file_granularity(). Returns NULL on failure.
+static void* file_map(file_t& f, cl_ulong offset, size_t size)
+{
+#ifdef _WIN32
+	return MapViewOfFile(f.Mapping, f.Write ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, size);
+#else
+	void* ptr = mmap(NULL, size, f.Write ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, f.Fd, (off_t)offset);
+	if(ptr == MAP_FAILED)
+		return NULL;
+	// Advice values are not flags, and must be given separately
+	if(!f.Write)
+	{
+		madvise(ptr, size, MADV_SEQUENTIAL);
+		madvise(ptr, size, MADV_WILLNEED);
+	}
+	return ptr;
+#endif
+}
+
+static void file_unmap(void* ptr, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+static void file_close(file_t& f)
+{
+#ifdef _WIN32
+	if(f.Mapping)
+		CloseHandle(f.Mapping);
+	CloseHandle(f.File);
+#else
+	close(f.Fd);
+#endif
+}
+
+struct file_chunk_t
+{
+	void* base;
+	size_t size;
+	cl_event event;
+};
+
+// Waits for the transfer of a chunk, then unmaps it. Keeps the first error in err.
+static void file_chunk_release(file_chunk_t& chunk, cl_int* err)
+{
+	if(!chunk.base)
+		return;
+	if(chunk.event)
+	{
+		cl_int res = clWaitForEvents(1, &chunk.event);
+		if(*err == CL_SUCCESS)
+			*err = res;
+		clReleaseEvent(chunk.event);
+	}
+	file_unmap(chunk.base, chunk.size);
+	chunk.base = NULL;
+	chunk.event = NULL;
+}
+
+// Maps the file by chunks and transfers them with non-blocking commands. At most two chunks
+// are mapped at any time: one being transferred while the next one is being mapped.
+// Returns NULL on success, or the description of a file error. OpenCL errors are stored in err.
+static const char* file_stream(cl_command_queue queue, cl_mem mem, file_t& f, size_t mem_offset, cl_ulong file_offset, size_t size, cl_int* err)
+{
+	file_chunk_t chunks[2] = { { NULL, 0, NULL }, { NULL, 0, NULL } };
+	const char* msg = NULL;
+	size_t granularity = file_granularity();
+	*err = CL_SUCCESS;
+	for(size_t done = 0, k = 0; done < size && *err == CL_SUCCESS; done += FILE_CHUNK_SIZE, k ^= 1)
+	{
+		file_chunk_t& chunk = chunks[k];
+		file_chunk_release(chunk, err);
+		if(*err != CL_SUCCESS)
+			break;
+		cl_ulong pos = file_offset + done;
+		size_t lead = (size_t)(pos % granularity);
+		size_t len = size - done < FILE_CHUNK_SIZE ? size - done : FILE_CHUNK_SIZE;
+		chunk.base = file_map(f, pos - lead, lead + len);
+		if(!chunk.base)
+		{
+			msg = file_error();
+			break;
+		}
+		chunk.size = lead + len;
+		char* ptr = (char*)chunk.base + lead;
+		if(f.Write)
+			*err = clEnqueueReadBuffer(queue, mem, CL_FALSE, mem_offset + done, len, ptr, 0, NULL, &chunk.event);
+		else
+			*err = clEnqueueWriteBuffer(queue, mem, CL_FALSE, mem_offset + done, len, ptr, 0, NULL, &chunk.event);
+		if(*err == CL_SUCCESS)
+			*err = clFlush(queue);
+	}
+	file_chunk_release(chunks[0], err);
+	file_chunk_release(chunks[1], err);
+	return msg;
+}
+
+struct batch_t
+{
+	command_t* cmds;
+	int nb;
+	size_t read_size;
+	bool has_host_data; // Writes or SVM buffers use values held by the list
+};
+
+// Validates the list of commands at idx. The commands, their kernel arguments and packed data
+// are stored in three scratch arrays left on the stack, and refer to values held by the list.
+static void check_batch(lua_State* L, int idx, batch_t& batch)
+{
+	int nb = (int)lua_rawlen(L, idx);
+	size_t nb_args = 0, packed_size = 0;
+	for(int i=0;i<nb;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		if(lua_type(L, -1) != LUA_TTABLE)
+			luaL_error(L, "command %d: expected table", i+1);
+		nb_args += lua_rawlen(L, -1);
+		int entry = lua_gettop(L);
+		lua_rawgeti(L, entry, 1);
+		lua_rawgeti(L, entry, 2);
+		lua_rawgeti(L, entry, 3);
+		lua_rawgeti(L, entry, 5);
+		CLKernel* kernel = (CLKernel*)CLObject::TestObject(L, entry+2, "kernel");
+		if(kernel)
+			packed_size += kernel->GetPackedSize();
+		else if(lua_type(L, entry+1) == LUA_TSTRING && strcmp(lua_tostring(L, entry+1), command_names[CMD_WRITE]) == 0)
+			packed_size += CLStruct::PackedSize(L, entry+3, entry+4);
+		lua_settop(L, entry-1);
+	}
+	command_t* cmds = (command_t*)lua_newuserdata(L, nb * sizeof(command_t));
+	kernel_arg_t* args = (kernel_arg_t*)lua_newuserdata(L, nb_args * sizeof(kernel_arg_t));
+	unsigned char* scratch = (unsigned char*)lua_newuserdata(L, packed_size);
+	int top = lua_gettop(L);
+	batch.cmds = cmds;
+	batch.nb = nb;
+	batch.read_size = 0;
+	batch.has_host_data = false;
+	for(int i=0;i<nb;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		int len = (int)lua_rawlen(L, top+1);
+		luaL_checkstack(L, len, "too many entries in command");
+		for(int j=1;j<=len;j++)
+			lua_rawgeti(L, top+1, j);
+		cmds[i].type = check_command_type(L, top+2, i+1);
+		check_command(L, top+3, len-1, cmds[i], args, &scratch, i+1);
+		if(cmds[i].type == CMD_KERNEL)
+			args += cmds[i].nb_args;
+		if(cmds[i].type == CMD_READ)
+			batch.read_size += cmds[i].size;
+		else if(cmds[i].type == CMD_WRITE || cmds[i].uses_svm)
+			batch.has_host_data = true;
+		lua_settop(L, top);
+	}
+}
+
+// Pushes the scratch array receiving the data of the read commands
+static void push_batch_reads(lua_State* L, const batch_t& batch)
+{
+	char* reads = (char*)lua_newuserdata(L, batch.read_size);
+	for(int i=0;i<batch.nb;i++)
+		if(batch.cmds[i].type == CMD_READ)
+		{
+			batch.cmds[i].data = reads;
+			reads += batch.cmds[i].size;
+		}
+}
+
+// Each command waits for the previous one. On failure, the queue is drained since
+// commands already enqueued may still be using the batch memory.
+static cl_int issue_batch(cl_command_queue queue, const batch_t& batch, cl_event* last)
+{
+	cl_event prev = NULL, event;
+	for(int i=0;i<batch.nb;i++)
+	{
+		cl_int err = issue_command(queue, batch.cmds[i], prev ? 1 : 0, prev ? &prev : NULL, &event);
+		if(prev)
+			clReleaseEvent(prev);
+		if(err != CL_SUCCESS)
+		{
+			clFinish(queue);
+			return err;
+		}
+		prev = event;
+	}
+	*last = prev;
+	return CL_SUCCESS;
+}
+
+// Pushes the event of the last command, followed by the results of the reads, if any.
+// Without reads, the table at anchor_idx is kept alive until the commands have completed.
+static int push_batch_results(lua_State* L, const batch_t& batch, cl_event last, int anchor_idx)
+{
+	CLEvent* ev = pushNewObject<CLEvent>(L, last);
+	ev->Release();
+	if(batch.read_size == 0)
+	{
+		if(batch.has_host_data && anchor_idx)
+		{
+			lua_pushvalue(L, anchor_idx);
+			ev->Anchor(L, -2);
+		}
+		return 1;
+	}
+	error_check(L, clWaitForEvents(1, &last));
+	int nb_ret = 1;
+	luaL_checkstack(L, batch.nb, "too many read commands");
+	for(int i=0;i<batch.nb;i++)
+		if(batch.cmds[i].type == CMD_READ)
+		{
+			lua_pushlstring(L, (const char*)batch.cmds[i].data, batch.cmds[i].size);
+			nb_ret++;
+		}
+	return nb_ret;
+}
+
+// Commands recorded by queue:record() and queue:stop(), validated once and replayed from C
+class CLGraph : public CLObject
+{
+public:
+	CLGraph(cl_command_queue queue, const batch_t& batch, double capture_time) 
+		: Queue(queue), Batch(batch), Last(NULL), CaptureTime(capture_time), ReplayTime(0), NbReplays(0) {}
+	virtual void Retain() { clRetainCommandQueue(Queue); }
+	virtual void Release()
+	{
+		// The recorded data is freed with this object
+		if(Last)
+		{
+			clWaitForEvents(1, &Last);
+			clReleaseEvent(Last);
+			Last = NULL;
+		}
+		clReleaseCommandQueue(Queue);
+	}
+	virtual const char* GetClassName() { return "graph"; }
+	virtual int GetInfo(lua_State* L)
+	{
+		lua_createtable(L, 0, 5);
+		lua_pushnumber(L, Batch.nb);
+		lua_setfield(L, -2, "commands");
+		lua_pushnumber(L, (lua_Number)Batch.read_size);
+		lua_setfield(L, -2, "read_size");
+		// Host times in seconds, to compare the cost of a replay with the one of the first capture
+		lua_pushnumber(L, CaptureTime);
+		lua_setfield(L, -2, "capture_time");
+		lua_pushnumber(L, ReplayTime);
+		lua_setfield(L, -2, "replay_time");
+		lua_pushnumber(L, NbReplays);
+		lua_setfield(L, -2, "replays");
+		return 1;
+	}
+	// graph:replay{ [index] = data } issues the recorded commands again. Write commands can be given
+	// new data by their index in the recording; the data is written at the recorded offset, and must
+	// fit before the end of the buffer. Sizes are checked against the values stored by queue:stop().
+	// Returns the same results as queue:submit.
+	int Replay(lua_State* L)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		lua_settop(L, 1);
+		check_type(L, 1, 1<<LUA_TTABLE|1<<LUA_TNIL);
+		int nb_patches = 0;
+		if(lua_type(L, 1) == LUA_TTABLE)
+			for(lua_pushnil(L); lua_next(L, 1); lua_pop(L, 1))
+				nb_patches++;
+		// Patches are undone after issuing, so that the graph never keeps pointers to the bindings
+		command_t* saved = (command_t*)lua_newuserdata(L, nb_patches * sizeof(command_t));
+		int* indexes = (int*)lua_newuserdata(L, nb_patches * sizeof(int));
+		int top = lua_gettop(L);
+		nb_patches = 0;
+		if(lua_type(L, 1) == LUA_TTABLE)
+			for(lua_pushnil(L); lua_next(L, 1); lua_settop(L, top+1))
+			{
+				int index = lua_type(L, top+1) == LUA_TNUMBER ? (int)lua_tonumber(L, top+1) : 0;
+				if(index < 1 || index > Batch.nb || Batch.cmds[index-1].type != CMD_WRITE)
+				{
+					Restore(saved, indexes, nb_patches);
+					luaL_error(L, "binding keys must be indexes of write commands");
+				}
+				command_t& cmd = Batch.cmds[index-1];
+				size_t size;
+				const char* data = lua_tolstring(L, top+2, &size);
+				if(lua_type(L, top+2) != LUA_TSTRING || size > cmd.max_size)
+				{
+					Restore(saved, indexes, nb_patches);
+					luaL_error(L, "binding %d: expected string fitting between the recorded offset and the end of the buffer", index);
+				}
+				saved[nb_patches] = cmd;
+				indexes[nb_patches++] = index-1;
+				cmd.data = data;
+				cmd.size = size;
+			}
+		push_batch_reads(L, Batch);
+		cl_event last;
+		cl_int err = issue_batch(Queue, Batch, &last);
+		Restore(saved, indexes, nb_patches);
+		error_check(L, err);
+		ReplayTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		NbReplays++;
+		if(Last)
+			clReleaseEvent(Last);
+		Last = last;
+		clRetainEvent(Last);
+		return push_batch_results(L, Batch, last, nb_patches ? 1 : 0);
+	}
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLGraph::Replay, "replay");
+	}
+private:
+	void Restore(const command_t* saved, const int* indexes, int nb)
+	{
+		for(int i=0;i<nb;i++)
+			Batch.cmds[indexes[i]] = saved[i];
+	}
+	cl_command_queue Queue;
+	batch_t Batch;
+	cl_event Last;
+	double CaptureTime, ReplayTime; // Time to validate the recording, and to issue the last replay
+	int NbReplays;
+};
+
+// Result of queue:read_async. The data follows the object in the same userdata.
+class CLFuture : public CLObject
+{
+public:
+	CLFuture(cl_event event, size_t size, const type_t& type) : Event(event), Size(size), Type(type) {}
+	virtual void Release()
+	{
+		// The read must be over before the memory is freed
+		if(Event)
+		{
+			clWaitForEvents(1, &Event);
+			clReleaseEvent(Event);
+			Event = NULL;
+		}
+	}
+	virtual const char* GetClassName() { return "future"; }
+	virtual int GetInfo(lua_State* L)
+	{
+		lua_createtable(L, 0, 2);
+		lua_pushnumber(L, (lua_Number)Size);
+		lua_setfield(L, -2, "size");
+		lua_pushnumber(L, (lua_Number)(Size / Type.size));
+		lua_setfield(L, -2, "count");
+		return 1;
+	}
+	const unsigned char* Data() const { return (const unsigned char*)(this + 1); }
+	void Wait(lua_State* L)
+	{
+		if(!Event)
+			return;
+		cl_int err = clWaitForEvents(1, &Event);
+		clReleaseEvent(Event);
+		Event = NULL;
+		error_check(L, err);
+	}
+	int Ready(lua_State* L)
+	{
+		cl_int status = CL_COMPLETE;
+		if(Event)
+			error_check(L, clGetEventInfo(Event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof status, &status, NULL));
+		if(status < 0)
+			error_check(L, status);
+		lua_pushboolean(L, status == CL_COMPLETE);
+		return 1;
+	}
+	int Get(lua_State* L)
+	{
+		Wait(L);
+		lua_pushlstring(L, (const char*)Data(), Size);
+		return 1;
+	}
+	// Event of the read, or nil once the data has been accessed
+	int GetEvent(lua_State* L)
+	{
+		if(!Event)
+			return 0;
+		pushNewObject<CLEvent>(L, Event);
+		return 1;
+	}
+	int Len(lua_State* L)
 	{
-		lua_pushlightuserdata(L, this);
-		lua_method* ud = (lua_method*)lua_newuserdata(L, sizeof fct);
-		*ud = fct;
-		lua_pushcclosure(L, CallMethod, 2); 
-		lua_setfield(L, -2, name); 
+		lua_pushnumber(L, (lua_Number)(Size / Type.size));
+		return 1;
 	}
-	void Register(lua_State* L)
+	// future[i] returns the element i, using the layout given to read_async
+	static int Index(lua_State* L)
 	{
-		lua_createtable(L, 0, 0);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, -2, "__index");
-		lua_pushliteral(L, "OpenCL metatable");
-		lua_setfield(L, -2, "__metatable");
-		AddMethods(L);
-		lua_setmetatable(L, -2);
+		if(lua_type(L, 2) != LUA_TNUMBER)
+		{
+			lua_getmetatable(L, 1);
+			lua_pushvalue(L, 2);
+			lua_rawget(L, -2);
+			return 1;
+		}
+		CLFuture* future = (CLFuture*)lua_touserdata(L, 1);
+		lua_Number index = lua_tonumber(L, 2);
+		// Written so that NaN is rejected, as well as non-integral indexes
+		if(!(index >= 1 && index <= future->Size / future->Type.size) || index != (lua_Number)(size_t)index)
+			return 0;
+		future->Wait(L);
+		CLStruct::Unpack(L, future->Type, future->Data() + ((size_t)index - 1) * future->Type.size);
+		return 1;
 	}
-	virtual const char* GetClassName() = 0;
-	int ToString(lua_State* L) { lua_pushfstring(L, "OpenCL %s (%p)", GetClassName(), this); return 1; }
-	int GC(lua_State* L) { Release(); return 0; }
 	virtual void AddMethods(lua_State* L)
 	{
-		AddMethod(L, &CLObject::GetInfo, "info");
-		AddMethod(L, &CLObject::ToString, "__tostring");
-		AddMethod(L, &CLObject::GC, "__gc");
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLFuture::Ready, "ready");
+		AddMethod(L, (lua_method)&CLFuture::Get, "get");
+		AddMethod(L, (lua_method)&CLFuture::GetEvent, "event");
+		AddMethod(L, (lua_method)&CLFuture::Len, "__len");
+		lua_pushcfunction(L, Index);
+		lua_setfield(L, -2, "__index");
 	}
 private:
+	cl_event Event;
+	size_t Size;
+	type_t Type;
 };
 
-class CLDevice : public CLObject
+class CLQueue : public CLObject
 {
 public:
-	CLDevice(cl_device_id id) : Handle(id) {}
-#ifdef CL_VERSION_1_2
-	virtual void Retain() { clRetainDevice(Handle); }
-	virtual void Release() { clReleaseDevice(Handle); }
+	CLQueue(cl_command_queue id) : Handle(id), Recording(false) {}
+	virtual void Retain() { clRetainCommandQueue(Handle); }
+	virtual void Release() { clReleaseCommandQueue(Handle); }
+	operator cl_command_queue const() { return Handle; }
+	virtual const char* GetClassName() { return "queue"; }
+	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_QUEUE, clGetCommandQueueInfo); }
+	int Flush(lua_State* L) { error_check(L, clFlush(Handle)); return 0; }
+	int Finish(lua_State* L) { error_check(L, clFinish(Handle)); return 0; }
+	int Write(lua_State* L)
+	{
+		if(Recording)
+			return RecordCommand(L, CMD_WRITE);
+		command_t cmd;
+		cmd.type = CMD_WRITE;
+		int nb = lua_gettop(L);
+		unsigned char* packed = (unsigned char*)lua_newuserdata(L, CLStruct::PackedSize(L, 2, 4));
+		unsigned char* scratch = packed;
+		check_command(L, 1, nb, cmd, NULL, &scratch, 0);
+		cl_event event;
+		error_check(L, issue_command(Handle, cmd, 0, NULL, &event));
+		CLEvent* ev = pushNewObject<CLEvent>(L, event);
+		ev->Release();
+		// Either the string or the packed data is used by the write
+		lua_createtable(L, 2, 0);
+		lua_pushvalue(L, 2);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, nb+1);
+		lua_rawseti(L, -2, 2);
+		ev->Anchor(L, -2);
+		return 1;
+	}
+	int Read(lua_State* L)
+	{
+		if(Recording)
+			return RecordCommand(L, CMD_READ);
+		command_t cmd;
+		cmd.type = CMD_READ;
+		check_command(L, 1, lua_gettop(L), cmd, NULL, NULL, 0);
+		luaL_Buffer buf;
+		cmd.data = luaL_buffinitsize(L, &buf, cmd.size);
+		cl_event event;
+		error_check(L, issue_command(Handle, cmd, 0, NULL, &event));
+		cl_int err = clWaitForEvents(1, &event);
+		clReleaseEvent(event);
+		error_check(L, err);
+		luaL_pushresultsize(&buf, cmd.size);
+		return 1;
+	}
+#ifdef CL_VERSION_2_0
+	// queue:map(svm, flags) gives the host access to a coarse-grained SVM buffer, until queue:unmap(svm)
+	int MapSvm(lua_State* L)
+	{
+		if(Recording)
+			luaL_error(L, "SVM mapping cannot be recorded");
+		CLSvm* svm = (CLSvm*)CheckObject(L, 1, "svm");
+		cl_map_flags flags = GetBitFieldValue(L, 2, EBT_MAP_FLAGS);
+		error_check(L, clEnqueueSVMMap(Handle, CL_TRUE, flags ? flags : CL_MAP_READ|CL_MAP_WRITE, svm->GetPointer(), svm->GetSize(), 0, NULL, NULL));
+		svm->SetMapped(true);
+		return 0;
+	}
+	int UnmapSvm(lua_State* L)
+	{
+		if(Recording)
+			luaL_error(L, "SVM mapping cannot be recorded");
+		CLSvm* svm = (CLSvm*)CheckObject(L, 1, "svm");
+		cl_event event;
+		svm->SetMapped(false);
+		error_check(L, clEnqueueSVMUnmap(Handle, svm->GetPointer(), 0, NULL, &event));
+		CLEvent* ev = pushNewObject<CLEvent>(L, event);
+		ev->Release();
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		ev->Anchor(L, -2);
+		return 1;
+	}
 #endif
-	operator cl_device_id const() { return Handle; }
-	virtual const char* GetClassName() { return "device"; }
-	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_DEVICE, clGetDeviceInfo); }
-private:
-	cl_device_id Handle;
-};
-
-class CLPlatform : public CLObject
-{
-public:
-	CLPlatform(cl_platform_id id) : Handle(id) {}
-	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_PLATFORM, clGetPlatformInfo); }
-	virtual const char* GetClassName() { return "platform"; }
-	int GetDevices(lua_State* L)
+	// queue:read_async(buf, offset, size, layout) starts a non-blocking read and returns a future.
+	// The data is waited for on first access, as elements of layout (bytes by default) or as a string.
+	int ReadAsync(lua_State* L)
 	{
-		cl_uint nb;
-		error_check(L, clGetDeviceIDs(Handle, CL_DEVICE_TYPE_ALL, 0, NULL, &nb));
-		cl_device_id* ids = (cl_device_id*) lua_newuserdata(L, nb * sizeof(cl_device_id));
-		error_check(L, clGetDeviceIDs(Handle, CL_DEVICE_TYPE_ALL, nb, ids, NULL));
-		lua_createtable(L, nb, 0);
-		for(cl_uint i=0;i<nb;i++)
+		if(Recording)
+			luaL_error(L, "asynchronous reads cannot be recorded");
+		command_t cmd;
+		cmd.type = CMD_READ;
+		lua_settop(L, 4);
+		type_t type;
+		if(lua_isnil(L, 4))
+			parse_type_name("uchar", type);
+		else
+			CLStruct::CheckType(L, 4, type);
+		check_command(L, 1, 3, cmd, NULL, NULL, 0);
+		void* ud = lua_newuserdata(L, sizeof(CLFuture) + cmd.size);
+		cmd.data = (CLFuture*)ud + 1;
+		cl_event event;
+		error_check(L, issue_command(Handle, cmd, 0, NULL, &event));
+		CLFuture* future = new(ud) CLFuture(event, cmd.size, type);
+		future->Register(L);
+		// Keeps a structure layout alive
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, 4);
+		lua_rawseti(L, -2, 1);
+		lua_setuservalue(L, -2);
+		return 1;
+	}
+	int Kernel(lua_State* L)
+	{
+		if(Recording)
+			return RecordCommand(L, CMD_KERNEL);
+		command_t cmd;
+		cmd.type = CMD_KERNEL;
+		int nb = lua_gettop(L);
+		CLKernel* kernel = (CLKernel*)TestObject(L, 1, "kernel");
+		kernel_arg_t* args = (kernel_arg_t*)lua_newuserdata(L, (nb > 3 ? nb - 3 : 0) * sizeof(kernel_arg_t));
+		unsigned char* scratch = (unsigned char*)lua_newuserdata(L, kernel ? kernel->GetPackedSize() : 0);
+		check_command(L, 1, nb, cmd, args, &scratch, 0);
+		cl_event event;
+		error_check(L, issue_command(Handle, cmd, 0, NULL, &event));
+		CLEvent* ev = pushNewObject<CLEvent>(L, event);
+		ev->Release();
+		if(cmd.uses_svm)
 		{
-			pushNewObject<CLDevice>(L, ids[i]);
+			// The kernel and the SVM arguments stay alive until the command has completed
+			lua_createtable(L, nb, 0);
+			for(int i=1;i<=nb;i++)
+			{
+				lua_pushvalue(L, i);
+				lua_rawseti(L, -2, i);
+			}
+			ev->Anchor(L, -2);
+		}
+		return 1;
+	}
+	// queue:write_file(buf, path, offset, size, file_offset) copies a file region into the buffer at offset.
+	// queue:read_file(buf, path, offset, size, file_offset) copies a buffer region into the file, which
+	// is created or extended as needed. Both return the number of bytes transferred.
+	int TransferFile(lua_State* L, bool to_file)
+	{
+		if(Recording)
+			luaL_error(L, "file transfers cannot be recorded");
+		file_t f;
+		cl_ulong length;
+		CLMem* mem = (CLMem*)CheckObject(L, 1, "buffer");
+		const char* path = luaL_checkstring(L, 2);
+		size_t offset = (size_t)luaL_optnumber(L, 3, 0);
+		cl_ulong file_offset = (cl_ulong)luaL_optnumber(L, 5, 0);
+		bool whole_file = lua_isnoneornil(L, 4);
+		size_t size = whole_file ? mem->GetSize(L) - offset : (size_t)luaL_checknumber(L, 4);
+		if(offset > mem->GetSize(L))
+			command_error(L, 0, 3, "offset exceeds buffer size");
+		if(size > mem->GetSize(L) - offset)
+			command_error(L, 0, 4, "range exceeds buffer size");
+		// All arguments are checked before opening the file, which must then be closed on every error
+		if(!file_open(f, path, to_file))
+			luaL_error(L, "%s: %s", path, file_error());
+		if(!file_size(f, &length))
+		{
+			file_close(f);
+			luaL_error(L, "%s: %s", path, file_error());
+		}
+		if(!to_file && whole_file)
+			size = file_offset < length ? (size_t)(length - file_offset) : 0;
+		if(!to_file && (file_offset > length || size > length - file_offset || size > mem->GetSize(L) - offset))
+		{
+			file_close(f);
+			luaL_error(L, "%s: range exceeds file or buffer size", path);
+		}
+		cl_int err = CL_SUCCESS;
+		const char* msg = NULL;
+		if(size)
+		{
+			if(!file_prepare(f, file_offset + size))
+				msg = file_error();
+			else
+				msg = file_stream(Handle, *mem, f, offset, file_offset, size, &err);
+		}
+		file_close(f);
+		if(msg)
+			luaL_error(L, "%s: %s", path, msg);
+		error_check(L, err);
+		lua_pushnumber(L, (lua_Number)size);
+		return 1;
+	}
+	int WriteFile(lua_State* L) { return TransferFile(L, false); }
+	int ReadFile(lua_State* L) { return TransferFile(L, true); }
+	// queue:submit{ {"write", buf, data, offset, layout}, {"kernel", k, global, local, args...}, {"read", buf} }
+	// The whole batch is validated before anything is enqueued. Each command waits for the previous one.
+	// Returns the event of the last command, followed by the results of the reads, if any.
+	int Submit(lua_State* L)
+	{
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_settop(L, 1);
+		if(Recording)
+		{
+			lua_rawgetp(L, LUA_REGISTRYINDEX, this);
+			int nb = (int)lua_rawlen(L, 1), len = (int)lua_rawlen(L, 2);
+			for(int i=0;i<nb;i++)
+			{
+				lua_rawgeti(L, 1, i+1);
+				lua_rawseti(L, 2, len+i+1);
+			}
+			return 0;
+		}
+		batch_t batch;
+		check_batch(L, 1, batch);
+		if(batch.nb == 0)
+			return 0;
+		push_batch_reads(L, batch);
+		cl_event last;
+		error_check(L, issue_batch(Handle, batch, &last));
+		// Writes use the strings of the list and the packed data
+		lua_createtable(L, 2, 0);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, 4);
+		lua_rawseti(L, -2, 2);
+		return push_batch_results(L, batch, last, lua_gettop(L));
+	}
+	// Until queue:stop(), commands are recorded instead of being issued, and return nothing
+	int Record(lua_State* L)
+	{
+		if(Recording)
+			luaL_error(L, "queue is already recording");
+		lua_newtable(L);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+		Recording = true;
+		return 0;
+	}
+	int RecordCommand(lua_State* L, eCommand type)
+	{
+		int nb = lua_gettop(L);
+		lua_createtable(L, nb+1, 0);
+		lua_pushstring(L, command_names[type]);
+		lua_rawseti(L, -2, 1);
+		for(int i=1;i<=nb;i++)
+		{
+			lua_pushvalue(L, i);
 			lua_rawseti(L, -2, i+1);
 		}
+		lua_rawgetp(L, LUA_REGISTRYINDEX, this);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, (int)lua_rawlen(L, -2)+1);
+		return 0;
+	}
+	// Validates the recorded commands and returns them as a graph
+	int Stop(lua_State* L)
+	{
+		if(!Recording)
+			luaL_error(L, "queue is not recording");
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		lua_settop(L, 0);
+		lua_rawgetp(L, LUA_REGISTRYINDEX, this);
+		lua_pushnil(L);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+		Recording = false;
+		// A graph always has a last command, whose event is returned by replay
+		if(lua_rawlen(L, 1) == 0)
+			luaL_error(L, "no command was recorded");
+		batch_t batch;
+		check_batch(L, 1, batch);
+		double capture_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		CLGraph* graph = new(lua_newuserdata(L, sizeof(CLGraph))) CLGraph(Handle, batch, capture_time);
+		graph->Retain();
+		graph->Register(L);
+		// The graph keeps the recorded values and the scratch arrays alive
+		lua_createtable(L, 4, 0);
+		for(int i=1;i<=4;i++)
+		{
+			lua_pushvalue(L, i);
+			lua_rawseti(L, -2, i);
+		}
+		lua_setuservalue(L, 5);
 		return 1;
 	}
+	int Collect(lua_State* L)
+	{
+		if(Recording)
+		{
+			lua_pushnil(L);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+		}
+		Release();
+		return 0;
+	}
 	virtual void AddMethods(lua_State* L)
 	{
 		CLObject::AddMethods(L);
-		AddMethod(L, (lua_method)&CLPlatform::GetDevices, "devices");
+		AddMethod(L, (lua_method)&CLQueue::Flush, "flush");
+		AddMethod(L, (lua_method)&CLQueue::Finish, "finish");
+		AddMethod(L, (lua_method)&CLQueue::Write, "write");
+		AddMethod(L, (lua_method)&CLQueue::Read, "read");
+		AddMethod(L, (lua_method)&CLQueue::ReadAsync, "read_async");
+#ifdef CL_VERSION_2_0
+		AddMethod(L, (lua_method)&CLQueue::MapSvm, "map");
+		AddMethod(L, (lua_method)&CLQueue::UnmapSvm, "unmap");
+#endif
+		AddMethod(L, (lua_method)&CLQueue::Kernel, "kernel");
+		AddMethod(L, (lua_method)&CLQueue::Submit, "submit");
+		AddMethod(L, (lua_method)&CLQueue::Record, "record");
+		AddMethod(L, (lua_method)&CLQueue::Stop, "stop");
+		AddMethod(L, (lua_method)&CLQueue::Collect, "__gc");
+		AddMethod(L, (lua_method)&CLQueue::WriteFile, "write_file");
+		AddMethod(L, (lua_method)&CLQueue::ReadFile, "read_file");
 	}
 private:
-	cl_platform_id Handle;
+	cl_command_queue Handle;
+	bool Recording;
 };
 
 class CLContext : public CLObject
@@ -339,6 +2407,144 @@ public:
 	operator cl_context const() { return Handle; }
 	virtual const char* GetClassName() { return "context"; }
 	virtual int GetInfo(lua_State* L) { return push_info(L, Handle, IT_CONTEXT, clGetContextInfo); }
+	int CreateQueue(lua_State* L)
+	{
+		cl_int err;
+		cl_device_id device;
+		if(lua_isnoneornil(L, 1))
+			error_check(L, clGetContextInfo(Handle, CL_CONTEXT_DEVICES, sizeof device, &device, NULL));
+		else
+			device = *(CLDevice*)CheckObject(L, 1, "device");
+		cl_command_queue_properties properties = GetBitFieldValue(L, 2, EBT_COMMAND_QUEUE_PROPERTIES);
+		cl_command_queue queue = clCreateCommandQueue(Handle, device, properties, &err);
+		error_check(L, err);
+		pushNewObject<CLQueue>(L, queue)->Release();
+		return 1;
+	}
+	int CreateBuffer(lua_State* L)
+	{
+		cl_int err;
+		size_t size;
+		void* host_ptr = NULL;
+		cl_mem_flags flags = GetBitFieldValue(L, 1, EBT_MEM_FLAGS);
+		check_type(L, 2, 1<<LUA_TNUMBER|1<<LUA_TSTRING);
+		if(lua_type(L, 2) == LUA_TSTRING)
+		{
+			host_ptr = (void*)lua_tolstring(L, 2, &size);
+			flags |= CL_MEM_COPY_HOST_PTR;
+		}
+		else
+			size = (size_t)lua_tonumber(L, 2);
+		cl_mem mem = clCreateBuffer(Handle, flags, size, host_ptr, &err);
+		error_check(L, err);
+		pushNewObject<CLMem>(L, mem)->Release();
+		return 1;
+	}
+	// Pushes a new program created from the source string or table of strings at idx
+	CLProgram* PushProgram(lua_State* L, int idx)
+	{
+		cl_int err;
+		cl_uint nb = 1;
+		int top = lua_gettop(L);
+		check_type(L, idx, 1<<LUA_TTABLE|1<<LUA_TSTRING);
+		if(lua_type(L, idx) == LUA_TTABLE)
+			nb = (cl_uint)lua_rawlen(L, idx);
+		const char** strings = (const char**)lua_newuserdata(L, nb * sizeof(const char*));
+		size_t* lengths = (size_t*)lua_newuserdata(L, nb * sizeof(size_t));
+		if(lua_type(L, idx) == LUA_TSTRING)
+			strings[0] = lua_tolstring(L, idx, &lengths[0]);
+		else
+			for(cl_uint i=0;i<nb;i++)
+			{
+				// The strings stay referenced by the table
+				lua_rawgeti(L, idx, i+1);
+				strings[i] = luaL_checklstring(L, -1, &lengths[i]);
+				lua_pop(L, 1);
+			}
+		cl_program program = clCreateProgramWithSource(Handle, nb, strings, lengths, &err);
+		error_check(L, err);
+		lua_settop(L, top);
+		CLProgram* obj = pushNewObject<CLProgram>(L, program);
+		obj->Release();
+		return obj;
+	}
+#ifdef CL_VERSION_2_0
+	// context:svm(layout, count, flags) allocates shared virtual memory for count elements
+	int CreateSvm(lua_State* L)
+	{
+		type_t type;
+		CLStruct::CheckType(L, 1, type);
+		size_t size = (size_t)luaL_checknumber(L, 2) * type.size;
+		cl_svm_mem_flags flags = GetBitFieldValue(L, 3, EBT_MEM_FLAGS);
+		if(!(flags & (CL_MEM_READ_WRITE|CL_MEM_WRITE_ONLY|CL_MEM_READ_ONLY)))
+			flags |= CL_MEM_READ_WRITE;
+		void* ptr = clSVMAlloc(Handle, flags, size, (cl_uint)type.alignment);
+		if(!ptr)
+			luaL_error(L, "OpenCL: SVM allocation failure");
+		CLSvm* svm = new(lua_newuserdata(L, sizeof(CLSvm))) CLSvm(Handle, ptr, size, (flags & CL_MEM_SVM_FINE_GRAIN_BUFFER) != 0, type);
+		svm->Retain();
+		svm->Register(L);
+		// Keeps a structure layout alive
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		lua_setuservalue(L, -2);
+		return 1;
+	}
+#endif
+	int CreateProgram(lua_State* L)
+	{
+		PushProgram(L, 1);
+		return 1;
+	}
+#ifdef CL_VERSION_1_1
+	// context:build_async(sources, options, devices) creates one program per source and builds
+	// them in parallel on worker threads. Returns the table of programs and the table of their build events.
+	int BuildAsync(lua_State* L)
+	{
+		cl_uint nb_devices;
+		lua_settop(L, 3);
+		luaL_checktype(L, 1, LUA_TTABLE);
+		const char* options = luaL_optstring(L, 2, NULL);
+		cl_device_id* devices = check_devices(L, 3, &nb_devices);
+		int nb = (int)lua_rawlen(L, 1);
+		lua_createtable(L, nb, 0);
+		int programs = lua_gettop(L);
+		// All programs are created first, so that an error does not leave any build pending
+		for(int i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, 1, i+1);
+			PushProgram(L, programs+1);
+			lua_rawseti(L, programs, i+1);
+			lua_pop(L, 1);
+		}
+		CLBuildPool* pool = push_build_pool(L, options, nb_devices, devices);
+		lua_createtable(L, nb, 0);
+		for(int i=0;i<nb;i++)
+		{
+			lua_rawgeti(L, programs, i+1);
+			pool->AddProgram(L, *(CLProgram*)lua_touserdata(L, -1), programs+1);
+			lua_rawseti(L, programs+2, i+1);
+			lua_pop(L, 1);
+		}
+		pool->Start();
+		lua_remove(L, programs+1);
+		return 2;
+	}
+#endif
+	virtual void AddMethods(lua_State* L)
+	{
+		CLObject::AddMethods(L);
+		AddMethod(L, (lua_method)&CLContext::CreateQueue, "queue");
+		AddMethod(L, (lua_method)&CLContext::CreateBuffer, "buffer");
+		AddMethod(L, (lua_method)&CLContext::CreateProgram, "program");
+#ifdef CL_VERSION_2_0
+		AddMethod(L, (lua_method)&CLContext::CreateSvm, "svm");
+#endif
+#ifdef CL_VERSION_1_1
+		AddMethod(L, (lua_method)&CLContext::BuildAsync, "build_async");
+#endif
+	}
 private:
 	cl_context Handle;
 };
@@ -365,6 +2571,282 @@ static int cl_platforms(lua_State* L)
 	return 1;
 }
 
+// Snapshots of the platform and device info tables, stored in a binary file:
+// a header followed by a tree of booleans, numbers, strings and tables. Other values are not stored.
+static const char snapshot_magic[8] = { 'L', 'u', 'a', 'C', 'L', 's', 'n', 'p' };
+static const cl_uint snapshot_version = 1; // Also detects byte order mismatches
+
+static bool snapshot_storable(lua_State* L, int idx)
+{
+	int t = lua_type(L, idx);
+	return t == LUA_TBOOLEAN || t == LUA_TNUMBER || t == LUA_TSTRING || t == LUA_TTABLE;
+}
+
+static void snapshot_write(lua_State* L, FILE* f, int idx)
+{
+	cl_uint len;
+	size_t size;
+	switch(lua_type(L, idx))
+	{
+	case LUA_TBOOLEAN:
+		fputc(lua_toboolean(L, idx) ? 'T' : 'F', f);
+		break;
+	case LUA_TNUMBER:
+	{
+		double val = lua_tonumber(L, idx);
+		fputc('d', f);
+		fwrite(&val, sizeof val, 1, f);
+		break;
+	}
+	case LUA_TSTRING:
+	{
+		const char* str = lua_tolstring(L, idx, &size);
+		len = (cl_uint)size;
+		fputc('s', f);
+		fwrite(&len, sizeof len, 1, f);
+		fwrite(str, 1, size, f);
+		break;
+	}
+	case LUA_TTABLE:
+		len = 0;
+		for(lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1))
+			if(snapshot_storable(L, -2) && snapshot_storable(L, -1))
+				len++;
+		fputc('t', f);
+		fwrite(&len, sizeof len, 1, f);
+		luaL_checkstack(L, 3, "snapshot too deep");
+		for(lua_pushnil(L); lua_next(L, idx); lua_pop(L, 1))
+			if(snapshot_storable(L, -2) && snapshot_storable(L, -1))
+			{
+				int top = lua_gettop(L);
+				snapshot_write(L, f, top-1);
+				snapshot_write(L, f, top);
+			}
+		break;
+	}
+}
+
+// Pushes the value read at p, and returns the position following it, or NULL if the data is corrupted
+static const char* snapshot_read(lua_State* L, const char* p, const char* end, int depth)
+{
+	cl_uint len;
+	if(p >= end || depth > 16)
+		return NULL;
+	luaL_checkstack(L, 3, "snapshot too deep");
+	switch(*p++)
+	{
+	case 'T':
+	case 'F':
+		lua_pushboolean(L, p[-1] == 'T');
+		return p;
+	case 'd':
+	{
+		double val;
+		if(end - p < (ptrdiff_t)sizeof val)
+			return NULL;
+		memcpy(&val, p, sizeof val);
+		lua_pushnumber(L, val);
+		return p + sizeof val;
+	}
+	case 's':
+		if(end - p < (ptrdiff_t)sizeof len)
+			return NULL;
+		memcpy(&len, p, sizeof len);
+		p += sizeof len;
+		if((size_t)(end - p) < len)
+			return NULL;
+		lua_pushlstring(L, p, len);
+		return p + len;
+	case 't':
+		if(end - p < (ptrdiff_t)sizeof len)
+			return NULL;
+		memcpy(&len, p, sizeof len);
+		p += sizeof len;
+		lua_createtable(L, 0, 0);
+		for(cl_uint i=0;i<len && p;i++)
+		{
+			p = snapshot_read(L, p, end, depth+1);
+			if(p)
+				p = snapshot_read(L, p, end, depth+1);
+			if(p)
+			{
+				if(lua_isnil(L, -2))
+					return NULL;
+				lua_rawset(L, -3);
+			}
+		}
+		return p;
+	default:
+		return NULL;
+	}
+}
+
+// Pushes the array of platforms, each one being { info = {...}, devices = { { info = {...}, platform = i, index = j }, ... } }
+static void push_topology(lua_State* L)
+{
+	cl_uint nb;
+	error_check(L, clGetPlatformIDs(0, NULL, &nb));
+	cl_platform_id* ids = (cl_platform_id*)lua_newuserdata(L, nb * sizeof(cl_platform_id));
+	error_check(L, clGetPlatformIDs(nb, ids, NULL));
+	lua_createtable(L, nb, 0);
+	for(cl_uint i=0;i<nb;i++)
+	{
+		lua_createtable(L, 0, 2);
+		push_info(L, ids[i], IT_PLATFORM, clGetPlatformInfo);
+		lua_setfield(L, -2, "info");
+		cl_uint nb_devices = 0;
+		cl_int err = clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, 0, NULL, &nb_devices);
+		if(err != CL_DEVICE_NOT_FOUND)
+			error_check(L, err);
+		cl_device_id* devices = (cl_device_id*)lua_newuserdata(L, nb_devices * sizeof(cl_device_id));
+		if(nb_devices)
+			error_check(L, clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, nb_devices, devices, NULL));
+		lua_createtable(L, nb_devices, 0);
+		for(cl_uint j=0;j<nb_devices;j++)
+		{
+			lua_createtable(L, 0, 3);
+			push_info(L, devices[j], IT_DEVICE, clGetDeviceInfo);
+			lua_setfield(L, -2, "info");
+			lua_pushnumber(L, i+1);
+			lua_setfield(L, -2, "platform");
+			lua_pushnumber(L, j+1);
+			lua_setfield(L, -2, "index");
+			lua_rawseti(L, -2, j+1);
+		}
+		lua_setfield(L, -3, "devices");
+		lua_pop(L, 1);
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_remove(L, -2);
+}
+
+// Compares the platform and device names and versions of the snapshot at idx with the installed ones
+static bool snapshot_valid(lua_State* L, int idx)
+{
+	cl_uint nb = 0;
+	int top = lua_gettop(L);
+	// Without any platform, the call fails and the snapshot is out of date unless it is empty
+	if(clGetPlatformIDs(0, NULL, &nb) != CL_SUCCESS)
+		return lua_rawlen(L, idx) == 0;
+	bool valid = nb == lua_rawlen(L, idx);
+	cl_platform_id* ids = (cl_platform_id*)lua_newuserdata(L, nb * sizeof(cl_platform_id));
+	valid = valid && clGetPlatformIDs(nb, ids, NULL) == CL_SUCCESS;
+	for(cl_uint i=0;i<nb && valid;i++)
+	{
+		lua_rawgeti(L, idx, i+1);
+		int platform = lua_gettop(L);
+		valid = lua_type(L, platform) == LUA_TTABLE 
+			&& info_matches(L, platform, "name", push_info_string(L, ids[i], CL_PLATFORM_NAME, clGetPlatformInfo))
+			&& info_matches(L, platform, "version", push_info_string(L, ids[i], CL_PLATFORM_VERSION, clGetPlatformInfo));
+		cl_uint nb_devices = 0;
+		cl_int err = clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, 0, NULL, &nb_devices);
+		if(err != CL_SUCCESS)
+			nb_devices = 0;
+		lua_getfield(L, platform, "devices");
+		int devices = lua_gettop(L);
+		valid = valid && (err == CL_SUCCESS || err == CL_DEVICE_NOT_FOUND) 
+			&& lua_type(L, devices) == LUA_TTABLE && nb_devices == lua_rawlen(L, devices);
+		cl_device_id* dev_ids = (cl_device_id*)lua_newuserdata(L, nb_devices * sizeof(cl_device_id));
+		valid = valid && (nb_devices == 0 || clGetDeviceIDs(ids[i], CL_DEVICE_TYPE_ALL, nb_devices, dev_ids, NULL) == CL_SUCCESS);
+		for(cl_uint j=0;j<nb_devices && valid;j++)
+		{
+			lua_rawgeti(L, devices, j+1);
+			int device = lua_gettop(L);
+			valid = lua_type(L, device) == LUA_TTABLE 
+				&& info_matches(L, device, "name", push_info_string(L, dev_ids[j], CL_DEVICE_NAME, clGetDeviceInfo))
+				&& info_matches(L, device, "driver_version", push_info_string(L, dev_ids[j], CL_DRIVER_VERSION, clGetDeviceInfo));
+			lua_settop(L, devices+1);
+		}
+		lua_settop(L, top+1);
+	}
+	lua_settop(L, top);
+	return valid;
+}
+
+// cl.snapshot(path) queries the platforms and devices, saves their info tables and returns them
+static int cl_snapshot(lua_State* L)
+{
+	const char* path = luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+	push_topology(L);
+	// The file is written next to the final one and then renamed over it,
+	// so that processes loading the snapshot meanwhile never see it partially written
+#ifdef _WIN32
+	const char* tmp_path = lua_pushfstring(L, "%s.%d.tmp", path, (int)GetCurrentProcessId());
+#else
+	const char* tmp_path = lua_pushfstring(L, "%s.%d.tmp", path, (int)getpid());
+#endif
+	FILE* f = fopen(tmp_path, "wb");
+	if(!f)
+		luaL_error(L, "%s: %s", tmp_path, strerror(errno));
+	fwrite(snapshot_magic, 1, sizeof snapshot_magic, f);
+	fwrite(&snapshot_version, sizeof snapshot_version, 1, f);
+	snapshot_write(L, f, 2);
+	bool failed = ferror(f) != 0;
+	if(fclose(f) || failed)
+	{
+		remove(tmp_path);
+		luaL_error(L, "%s: write error", tmp_path);
+	}
+#ifdef _WIN32
+	failed = !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	failed = rename(tmp_path, path) != 0;
+#endif
+	if(failed)
+	{
+		const char* msg = file_error();
+		remove(tmp_path);
+		luaL_error(L, "%s: %s", path, msg);
+	}
+	lua_settop(L, 2);
+	return 1;
+}
+
+// cl.load_snapshot(path, validate) returns the tables saved by cl.snapshot, without opening any device.
+// Unless validate is false, returns nil and a message if the installed platforms or drivers changed.
+// The devices of a snapshot can be given to cl.context and cl.device, which open them.
+static int cl_load_snapshot(lua_State* L)
+{
+	const char* path = luaL_checkstring(L, 1);
+	bool validate = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	FILE* f = fopen(path, "rb");
+	if(!f)
+		luaL_error(L, "%s: %s", path, strerror(errno));
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* data = size > 0 ? (char*)lua_newuserdata(L, size) : NULL;
+	bool failed = !data || fread(data, 1, size, f) != (size_t)size;
+	fclose(f);
+	cl_uint version;
+	const char* p = NULL;
+	if(!failed && (size_t)size >= sizeof snapshot_magic + sizeof version && memcmp(data, snapshot_magic, sizeof snapshot_magic) == 0)
+	{
+		memcpy(&version, data + sizeof snapshot_magic, sizeof version);
+		if(version == snapshot_version)
+			p = snapshot_read(L, data + sizeof snapshot_magic + sizeof version, data + size, 0);
+	}
+	if(!p || lua_type(L, -1) != LUA_TTABLE)
+		luaL_error(L, "%s: invalid snapshot file", path);
+	if(validate && !snapshot_valid(L, lua_gettop(L)))
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "snapshot is out of date");
+		return 2;
+	}
+	return 1;
+}
+
+// cl.device(entry) opens a device from a snapshot
+static int cl_device(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	pushNewObject<CLDevice>(L, resolve_device(L, 1));
+	return 1;
+}
+
 static void check_type(lua_State* L, int idx, int types)
 {
 	int t = lua_type(L, idx);
@@ -395,16 +2877,8 @@ static int cl_new_context(lua_State* L)
 		; // TODO
 	if(lua_type(L, 1) == LUA_TTABLE)
 	{
-		size_t nb = lua_rawlen(L, 1);
-		cl_device_id* devices = (cl_device_id*)lua_newuserdata(L, nb*sizeof(cl_device_id));
-		int top = lua_gettop(L);
-		for(size_t i=0;i<nb;i++)
-		{
-			lua_rawgeti(L, 1, i+1);
-			CLDevice* dev = (CLDevice*)CLObject::CheckObject(L, top+1, "device");
-			devices[i] = *dev;
-			lua_settop(L, top);
-		}
+		cl_uint nb;
+		cl_device_id* devices = check_devices(L, 1, &nb);
 		context = clCreateContext(properties, nb, devices, NULL, NULL, &err);
 	}
 	else
@@ -416,10 +2890,70 @@ static int cl_new_context(lua_State* L)
 	pushNewObject<CLContext>(L, context)->Release();
 	return 1;
 }
+// cl.wait(events) blocks until all the events have completed
+static int cl_wait(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	cl_uint nb = (cl_uint)lua_rawlen(L, 1);
+	cl_event* events = (cl_event*)lua_newuserdata(L, nb * sizeof(cl_event));
+	int top = lua_gettop(L);
+	for(cl_uint i=0;i<nb;i++)
+	{
+		lua_rawgeti(L, 1, i+1);
+		events[i] = *(CLEvent*)CLObject::CheckObject(L, top+1, "event");
+		lua_settop(L, top);
+	}
+	if(nb)
+		error_check(L, clWaitForEvents(nb, events));
+	return 0;
+}
+
+#ifdef CL_VERSION_1_2
+// cl.link(programs, options, devices) links compiled objects or libraries into a new program
+static int cl_link(lua_State* L)
+{
+	cl_int err;
+	cl_uint nb_devices;
+	lua_settop(L, 3);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	const char* options = luaL_optstring(L, 2, NULL);
+	cl_device_id* devices = check_devices(L, 3, &nb_devices);
+	cl_uint nb = (cl_uint)lua_rawlen(L, 1);
+	if(nb == 0)
+		luaL_error(L, "expected at least one program to link");
+	cl_program* programs = (cl_program*)lua_newuserdata(L, nb * sizeof(cl_program));
+	int top = lua_gettop(L);
+	for(cl_uint i=0;i<nb;i++)
+	{
+		lua_rawgeti(L, 1, i+1);
+		programs[i] = *(CLProgram*)CLObject::CheckObject(L, top+1, "program");
+		lua_settop(L, top);
+	}
+	cl_context context;
+	error_check(L, clGetProgramInfo(programs[0], CL_PROGRAM_CONTEXT, sizeof context, &context, NULL));
+	cl_program program = clLinkProgram(context, nb_devices, devices, options, nb, programs, NULL, NULL, &err);
+	if(program)
+		pushNewObject<CLProgram>(L, program)->Release();
+	if(err == CL_LINK_PROGRAM_FAILURE && program)
+		build_error(L, program, err);
+	error_check(L, err);
+	return 1;
+}
+#endif
+
 static const luaL_Reg cllib[] = 
 {
 	{ "platforms",   cl_platforms},
 	{ "context",     cl_new_context},
+	{ "wait",        cl_wait},
+	{ "device",      cl_device},
+	{ "snapshot",    cl_snapshot},
+	{ "load_snapshot", cl_load_snapshot},
+	{ "type",        CLStruct::NewType},
+	{ "struct",      CLStruct::NewStruct},
+#ifdef CL_VERSION_1_2
+	{ "link",        cl_link},
+#endif
 	{ NULL, NULL}
 };
 
@@ -443,6 +2977,13 @@ extern "C" int luaopen_cl(lua_State* L)
 #define E1_2(a,b)
 #define V1_2(a,b,c)
 #endif
+#ifdef CL_VERSION_2_0
+#define E2_0(a,b) { a,b },
+#define V2_0(a,b,c) { a,b,c },
+#else
+#define E2_0(a,b)
+#define V2_0(a,b,c)
+#endif
 #define E1_0(a,b) { a,b },
 #define V1_0(a,b,c) { a,b,c },
 
@@ -507,6 +3048,8 @@ static const error_info_t error_info_list[] =
 	E1_2( CL_INVALID_COMPILER_OPTIONS,                  "invalid compiler options"  )      
 	E1_2( CL_INVALID_LINKER_OPTIONS,                    "invalid linker options"  )        
 	E1_2( CL_INVALID_DEVICE_PARTITION_COUNT,            "invalid device partition count"  )
+	E2_0( CL_INVALID_PIPE_SIZE,                         "invalid pipe size" )
+	E2_0( CL_INVALID_DEVICE_QUEUE,                      "invalid device queue" )
 };
 
 static const info_list_t info_list[] = 
@@ -561,7 +3104,7 @@ static const info_list_t info_list[] =
 	V1_0( CL_DEVICE_QUEUE_PROPERTIES,                   "queue_properties",                 pushBitField<EBT_COMMAND_QUEUE_PROPERTIES> )
 	V1_0( CL_DEVICE_NAME,                               "name",                             push<char[]> )
 	V1_0( CL_DEVICE_VENDOR,                             "vendor",                           push<char[]> )
-	V1_0( CL_DRIVER_VERSION,                            "version",                          push<char[]> )
+	V1_0( CL_DRIVER_VERSION,                            "driver_version",                   push<char[]> )
 	V1_0( CL_DEVICE_PROFILE,                            "profile",                          push<char[]> )
 	V1_0( CL_DEVICE_VERSION,                            "version",                          push<char[]> )
 	V1_0( CL_DEVICE_EXTENSIONS,                         "extensions",                       push<char[]> )
@@ -589,6 +3132,21 @@ static const info_list_t info_list[] =
 	V1_2( CL_DEVICE_REFERENCE_COUNT,                    "reference_count",                  push<cl_uint> )
 	V1_2( CL_DEVICE_PREFERRED_INTEROP_USER_SYNC,        "preferred_interop_user_sync",      push<bool> )
 	V1_2( CL_DEVICE_PRINTF_BUFFER_SIZE,                 "printf_buffer_size",               push<size_t> )
+	V2_0( CL_DEVICE_MAX_READ_WRITE_IMAGE_ARGS,          "max_read_write_image_args",        push<cl_uint> )
+	V2_0( CL_DEVICE_MAX_GLOBAL_VARIABLE_SIZE,           "max_global_variable_size",         push<size_t> )
+	V2_0( CL_DEVICE_QUEUE_ON_DEVICE_PROPERTIES,         "queue_on_device_properties",       pushBitField<EBT_COMMAND_QUEUE_PROPERTIES> )
+	V2_0( CL_DEVICE_QUEUE_ON_DEVICE_PREFERRED_SIZE,     "queue_on_device_preferred_size",   push<cl_uint> )
+	V2_0( CL_DEVICE_QUEUE_ON_DEVICE_MAX_SIZE,           "queue_on_device_max_size",         push<cl_uint> )
+	V2_0( CL_DEVICE_MAX_ON_DEVICE_QUEUES,               "max_on_device_queues",             push<cl_uint> )
+	V2_0( CL_DEVICE_MAX_ON_DEVICE_EVENTS,               "max_on_device_events",             push<cl_uint> )
+	V2_0( CL_DEVICE_SVM_CAPABILITIES,                   "svm_capabilities",                 pushBitField<EBT_DEVICE_SVM_CAPABILITIES> )
+	V2_0( CL_DEVICE_GLOBAL_VARIABLE_PREFERRED_TOTAL_SIZE, "global_variable_preferred_total_size", push<size_t> )
+	V2_0( CL_DEVICE_MAX_PIPE_ARGS,                      "max_pipe_args",                    push<cl_uint> )
+	V2_0( CL_DEVICE_PIPE_MAX_ACTIVE_RESERVATIONS,       "pipe_max_active_reservations",     push<cl_uint> )
+	V2_0( CL_DEVICE_PIPE_MAX_PACKET_SIZE,               "pipe_max_packet_size",             push<cl_uint> )
+	V2_0( CL_DEVICE_PREFERRED_PLATFORM_ATOMIC_ALIGNMENT, "preferred_platform_atomic_alignment", push<cl_uint> )
+	V2_0( CL_DEVICE_PREFERRED_GLOBAL_ATOMIC_ALIGNMENT,  "preferred_global_atomic_alignment", push<cl_uint> )
+	V2_0( CL_DEVICE_PREFERRED_LOCAL_ATOMIC_ALIGNMENT,   "preferred_local_atomic_alignment", push<cl_uint> )
 	V1_0( CL_CONTEXT_REFERENCE_COUNT,                   "reference_count",                  push<cl_uint> )
 	V1_0( CL_CONTEXT_DEVICES,                           "devices",                          pushArray<cl_device_id> )
 	V1_0( CL_CONTEXT_PROPERTIES,                        "properties",                       pushArray<cl_context_properties> )
@@ -606,6 +3164,7 @@ static const info_list_t info_list[] =
 	V1_0( CL_MEM_CONTEXT,                               "context",                          push<cl_context> )
 	V1_1( CL_MEM_ASSOCIATED_MEMOBJECT,                  "associated_memobject",             push<cl_mem> )
 	V1_1( CL_MEM_OFFSET,                                "offset",                           push<size_t> )
+	V2_0( CL_MEM_USES_SVM_POINTER,                      "uses_svm_pointer",                 push<bool> )
 	V1_0( CL_IMAGE_FORMAT,                              "format",                           push<cl_image_format> )
 	V1_0( CL_IMAGE_ELEMENT_SIZE,                        "element_size",                     push<size_t> )
 	V1_0( CL_IMAGE_ROW_PITCH,                           "row_pitch",                        push<size_t> )
@@ -628,7 +3187,6 @@ static const info_list_t info_list[] =
 	V1_0( CL_PROGRAM_DEVICES,                           "devices",                          pushArray<cl_device_id> )
 	V1_0( CL_PROGRAM_SOURCE,                            "source",                           push<char[]> )
 	V1_0( CL_PROGRAM_BINARY_SIZES,                      "binary_sizes",                     pushArray<size_t> )
-	V1_0( CL_PROGRAM_BINARIES,                          "binaries",                         pushBinaries )
 	V1_2( CL_PROGRAM_NUM_KERNELS,                       "num_kernels",                      push<size_t> )
 	V1_2( CL_PROGRAM_KERNEL_NAMES,                      "kernel_names",                     push<char[]> )
 	V1_0( CL_PROGRAM_BUILD_STATUS,                      "build_status",                     pushEnum<EBT_BUILD_STATUS> )
@@ -710,6 +3268,8 @@ static const enum_list_t enum_info_list[] =
 	V1_2( EBT_MEM_FLAGS,                    CL_MEM_HOST_WRITE_ONLY,                       "host_write_only" )
 	V1_2( EBT_MEM_FLAGS,                    CL_MEM_HOST_READ_ONLY,                        "host_read_only" )
 	V1_2( EBT_MEM_FLAGS,                    CL_MEM_HOST_NO_ACCESS,                        "host_no_access" )
+	V2_0( EBT_MEM_FLAGS,                    CL_MEM_SVM_FINE_GRAIN_BUFFER,                 "svm_fine_grain_buffer" )
+	V2_0( EBT_MEM_FLAGS,                    CL_MEM_SVM_ATOMICS,                           "svm_atomics" )
 	V1_2( EBT_MEM_MIGRATION_FLAGS,          CL_MIGRATE_MEM_OBJECT_HOST,                   "host" )
 	V1_2( EBT_MEM_MIGRATION_FLAGS,          CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED,      "content_undefined" )
 	V1_0( EBT_CHANNEL_ORDER,                CL_R,                                         "r" )
@@ -802,21 +3362,35 @@ static const enum_list_t enum_info_list[] =
 	V1_2( EBT_COMMAND_TYPE,                 CL_COMMAND_MIGRATE_MEM_OBJECTS,               "migrate_mem_objects" )  
 	V1_2( EBT_COMMAND_TYPE,                 CL_COMMAND_FILL_BUFFER,                       "fill_buffer" )          
 	V1_2( EBT_COMMAND_TYPE,                 CL_COMMAND_FILL_IMAGE,                        "fill_image" )           
+	V2_0( EBT_COMMAND_TYPE,                 CL_COMMAND_SVM_FREE,                          "svm_free" )
+	V2_0( EBT_COMMAND_TYPE,                 CL_COMMAND_SVM_MEMCPY,                        "svm_memcpy" )
+	V2_0( EBT_COMMAND_TYPE,                 CL_COMMAND_SVM_MEMFILL,                       "svm_memfill" )
+	V2_0( EBT_COMMAND_TYPE,                 CL_COMMAND_SVM_MAP,                           "svm_map" )
+	V2_0( EBT_COMMAND_TYPE,                 CL_COMMAND_SVM_UNMAP,                         "svm_unmap" )
 	V1_0( EBT_COMMAND_EXECUTION_STATUS,     CL_COMPLETE,                                  "complete" )
 	V1_0( EBT_COMMAND_EXECUTION_STATUS,     CL_RUNNING,                                   "running" )
 	V1_0( EBT_COMMAND_EXECUTION_STATUS,     CL_SUBMITTED,                                 "submitted" )
 	V1_0( EBT_COMMAND_EXECUTION_STATUS,     CL_QUEUED,                                    "queued" )
 	V1_1( EBT_BUFFER_CREATE_TYPE,           CL_BUFFER_CREATE_TYPE_REGION,                 "region" )
+	V2_0( EBT_DEVICE_SVM_CAPABILITIES,      CL_DEVICE_SVM_COARSE_GRAIN_BUFFER,            "coarse_grain_buffer" )
+	V2_0( EBT_DEVICE_SVM_CAPABILITIES,      CL_DEVICE_SVM_FINE_GRAIN_BUFFER,              "fine_grain_buffer" )
+	V2_0( EBT_DEVICE_SVM_CAPABILITIES,      CL_DEVICE_SVM_FINE_GRAIN_SYSTEM,              "fine_grain_system" )
+	V2_0( EBT_DEVICE_SVM_CAPABILITIES,      CL_DEVICE_SVM_ATOMICS,                        "atomics" )
 };
 
 static const cl_ushort first_info_ids[IT_MAX+1] = {
 	CL_PLATFORM_PROFILE, CL_DEVICE_TYPE, CL_CONTEXT_REFERENCE_COUNT, CL_QUEUE_CONTEXT, 
 	CL_MEM_TYPE, CL_IMAGE_FORMAT, CL_SAMPLER_REFERENCE_COUNT, CL_PROGRAM_REFERENCE_COUNT,
-	CL_PROGRAM_BUILD_STATUS, CL_KERNEL_FUNCTION_NAME, CL_KERNEL_WORK_GROUP_SIZE,
+	CL_PROGRAM_BUILD_STATUS, CL_KERNEL_FUNCTION_NAME, 
+#ifdef CL_VERSION_1_2
+	CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+#else
+	CL_KERNEL_WORK_GROUP_SIZE,
+#endif
+	CL_KERNEL_WORK_GROUP_SIZE,
 	CL_EVENT_COMMAND_QUEUE, CL_PROFILING_COMMAND_QUEUED, 0xFFFF
 };
 
-#define countof(a) (sizeof(a)/sizeof(a[0]))
 // Some functions for handling those tables
 static int getInfoTable(const info_list_t*& pinfo, eInfoTable info_table)
 {
@@ -835,24 +3409,23 @@ static int getEnumTable(const enum_list_t*& ptable, enumTypes enum_type)
 		if(enum_info_list[i].type_id == enum_type)
 			break;
 	ptable = enum_info_list + i;
-	for(j=i;i<countof(enum_info_list);j++)
+	for(j=i;j<countof(enum_info_list);j++)
 		if(enum_info_list[j].type_id != enum_type)
 			break;
 	return (int)(j-i);
 }
 
+static const char* error_string(int error_code)
+{
+	for(size_t i=0;i<countof(error_info_list);i++)
+		if(error_info_list[i].id == error_code)
+			return error_info_list[i].name;
+	return "unknown error";
+}
+
 static void error_check(lua_State* L, int error_code)
 {
 	if(error_code == CL_SUCCESS)
 		return;
-	const char* str = "unknown error";
-	for(size_t i=0;i<countof(error_info_list);i++)
-	{
-		if(error_info_list[i].id == error_code)
-		{
-			str = error_info_list[i].name;
-			break;
-		}
-	}
-	luaL_error(L, "OpenCL: %s", str);
+	luaL_error(L, "OpenCL: %s", error_string(error_code));
 }